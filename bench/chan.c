@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2021 ooichu
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See `lifo.c` for details.
+ */
+
+/*
+ * Throughput of channel: one context sends messages on its thread, other
+ * receives them on main thread. Output has format of 'suite.c', blocks are
+ * counted by receiver.
+ * Build: gcc -obench_chan bench/chan.c -DLF_THREADS -pthread -lm
+ * Run from root of repository, it loads 'lib.lf'.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include "../src/lifo.c" /* lf_ctx is defined only there */
+#include <time.h>
+
+#define COUNT 200000
+
+typedef struct
+{
+	const char* text;
+	unsigned i;
+}
+source;
+
+static char readstr(void* rdat)
+{
+	source* src = (source*)rdat;
+	return src->text[src->i] != '\0' ? src->text[src->i++] : '\0';
+}
+
+static char readfile(void* rdat)
+{
+	int c = fgetc((FILE*)rdat);
+	return c == EOF ? '\0' : c;
+}
+
+static void writefn(void* wdat, char c)
+{
+	(void) wdat;
+	fputc(c, stdout);
+}
+
+static void eval(lf_ctx* ctx, const char* text)
+{
+	source src;
+	lf_chk* chk = NULL;
+	src.text = text;
+	src.i = 0;
+	if (lf_read(ctx, &chk, &src) == LF_SOK)
+	{
+		lf_eval(ctx, chk);
+	}
+	lf_wipe(ctx, &chk);
+}
+
+static lf_chan chan;
+static unsigned long slots[4096];
+static lf_ctx sender, receiver;
+static char sender_mem[1 << 20], receiver_mem[1 << 20];
+static char send_code[128], recv_code[128];
+
+static void setup(lf_ctx* ctx, char* mem, unsigned size)
+{
+	lf_chk* chk = NULL;
+	FILE* fp = fopen("lib.lf", "r");
+	lf_init(ctx);
+	lf_map_mem(ctx, mem, size);
+	lf_cfg_io(ctx, readfile, writefn, NULL);
+	if (fp != NULL)
+	{
+		lf_read(ctx, &chk, fp);
+		lf_eval(ctx, chk);
+		lf_wipe(ctx, &chk);
+		fclose(fp);
+	}
+	lf_cfg_io(ctx, readstr, NULL, NULL);
+	lf_push_chn(ctx, &chan);
+	lf_push_str(ctx, "ch", 0);
+	lf_reg(ctx);
+}
+
+static void* send_all(void* arg)
+{
+	(void) arg;
+	eval(&sender, send_code);
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void bench(const char* name, const char* msg)
+{
+	pthread_t thrd;
+	lf_stats st;
+	double t;
+	sprintf(send_code, "%d [dup 0 >] [%s ch send --] loop pop", COUNT, msg);
+	sprintf(recv_code, "%d [dup 0 >] [ch recv pop --] loop pop", COUNT);
+	lf_mem_reset(&receiver);
+	t = now();
+	pthread_create(&thrd, NULL, send_all, NULL);
+	eval(&receiver, recv_code);
+	pthread_join(thrd, NULL);
+	t = now() - t;
+	lf_mem_stats(&receiver, &st);
+	printf("chan-%s\t%d\t%.1f\t%.2f\t%lu\n", name, COUNT, t * 1e9 / COUNT,
+		(double)st.allocs / COUNT, st.peak);
+}
+
+int main(void)
+{
+	lf_chan_init(&chan, slots, sizeof(slots), 64);
+	setup(&sender, sender_mem, sizeof(sender_mem));
+	setup(&receiver, receiver_mem, sizeof(receiver_mem));
+	bench("number", "1");
+	bench("string", "\"message\"");
+	bench("list", "[1 2 [3 4] \"five\"]");
+	return 0;
+}
@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2021 ooichu
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See `lifo.c` for details.
+ */
+
+/*
+ * Fixed set of workloads of interpreter. Each workload runs in new context
+ * (with 'lib.lf' loaded) and is repeated REPEAT times, the fastest run is
+ * reported. Output is one tab-separated line per workload:
+ *
+ *   name  ops  ns/op  blocks/op  peak
+ *
+ * where 'blocks/op' is count of allocated blocks per operation and 'peak' is
+ * most blocks used at once by workload. Lines can be compared across commits
+ * by diff or any table tool.
+ * Build: gcc -obench_suite bench/suite.c -lm -O3
+ * Run from root of repository, it loads 'lib.lf'. Argument, if given, runs
+ * only workloads which names start with it.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include "../src/lifo.c" /* lf_ctx is defined only there */
+#include <time.h>
+
+#define REPEAT 5
+#define TEXT_SIZE (1 << 20)
+
+typedef struct
+{
+	const char* text;
+	unsigned long i;
+}
+source;
+
+static char readstr(void* rdat)
+{
+	source* src = (source*)rdat;
+	return src->text[src->i] != '\0' ? src->text[src->i++] : '\0';
+}
+
+static char readfile(void* rdat)
+{
+	int c = fgetc((FILE*)rdat);
+	return c == EOF ? '\0' : c;
+}
+
+static void writefn(void* wdat, char c)
+{
+	(void) wdat;
+	fputc(c, stderr);
+}
+
+static lf_ctx ctx;
+static char mem[1 << 24];
+static char text[TEXT_SIZE];
+static const char* filter = "";
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static lf_chk* read_code(const char* txt)
+{
+	source src;
+	lf_chk* chk = NULL;
+	src.text = txt;
+	src.i = 0;
+	if (lf_read(&ctx, &chk, &src) != LF_SOK)
+	{
+		lf_wipe(&ctx, &chk);
+	}
+	return chk;
+}
+
+/* New context with 'lib.lf' and definitions of 'setup' */
+static void open_ctx(const char* setup)
+{
+	lf_chk* chk = NULL;
+	FILE* fp = fopen("lib.lf", "r");
+	lf_init(&ctx);
+	lf_map_mem(&ctx, mem, sizeof(mem));
+	lf_cfg_io(&ctx, readfile, writefn, NULL);
+	if (fp != NULL)
+	{
+		lf_read(&ctx, &chk, fp);
+		lf_eval(&ctx, chk);
+		lf_wipe(&ctx, &chk);
+		fclose(fp);
+	}
+	lf_cfg_io(&ctx, readstr, writefn, NULL);
+	if (setup != NULL && (chk = read_code(setup)) != NULL)
+	{
+		lf_eval(&ctx, chk);
+		lf_wipe(&ctx, &chk);
+	}
+}
+
+static void report(const char* name, unsigned long ops, double t)
+{
+	lf_stats st;
+	lf_mem_stats(&ctx, &st);
+	printf("%s\t%lu\t%.1f\t%.2f\t%lu\n", name, ops, t * 1e9 / ops,
+		(double)st.allocs / REPEAT / ops, st.peak);
+}
+
+static int skip(const char* name)
+{
+	return strncmp(name, filter, strlen(filter)) != 0;
+}
+
+/* Evaluate 'code' that does 'ops' operations and leaves stack as it was */
+static void bench_eval(const char* name, const char* setup, const char* code,
+	unsigned long ops)
+{
+	lf_chk* chk;
+	double t, best = 0;
+	int i;
+	if (skip(name))
+	{
+		return;
+	}
+	open_ctx(setup);
+	if ((chk = read_code(code)) == NULL)
+	{
+		printf("%s\tread error\n", name);
+		return;
+	}
+	lf_mem_reset(&ctx);
+	for (i = 0; i < REPEAT; ++i)
+	{
+		t = now();
+		if (lf_eval(&ctx, chk) != LF_SOK)
+		{
+			printf("%s\teval error\n", name);
+			lf_wipe(&ctx, &chk);
+			return;
+		}
+		t = now() - t;
+		best = i == 0 || t < best ? t : best;
+	}
+	report(name, ops, best);
+	lf_wipe(&ctx, &chk);
+}
+
+/* Read 'text' of 'ops' tokens */
+static void bench_read(const char* name, unsigned long ops)
+{
+	lf_chk* chk;
+	double t, best = 0;
+	int i;
+	if (skip(name))
+	{
+		return;
+	}
+	open_ctx(NULL);
+	lf_mem_reset(&ctx);
+	for (i = 0; i < REPEAT; ++i)
+	{
+		t = now();
+		chk = read_code(text);
+		t = now() - t;
+		if (chk == NULL)
+		{
+			printf("%s\tread error\n", name);
+			return;
+		}
+		lf_wipe(&ctx, &chk);
+		best = i == 0 || t < best ? t : best;
+	}
+	report(name, ops, best);
+}
+
+/* Text of 'n' string literals */
+static unsigned long make_strings(unsigned long n)
+{
+	unsigned long i, len = 0;
+	for (i = 0; i < n; ++i)
+	{
+		len += sprintf(text + len, "\"string number %lu of text\" ", i);
+	}
+	return n;
+}
+
+/* Program of 'n' definitions, 17 tokens each */
+static unsigned long make_program(unsigned long n)
+{
+	unsigned long i, len = 0;
+	for (i = 0; i < n; ++i)
+	{
+		len += sprintf(text + len,
+			"[dup %lu < [1.5 +] [\"w\" num>str] if [a [b c] %lu]] \"w%lu\" ;\n",
+			i, i * 7, i);
+	}
+	return n * 17;
+}
+
+static unsigned long fib_calls(unsigned n)
+{
+	return n < 2 ? 1 : 1 + fib_calls(n - 1) + fib_calls(n - 2);
+}
+
+int main(int argc, char** argv)
+{
+	if (argc > 1)
+	{
+		filter = argv[1];
+	}
+	printf("name\tops\tns/op\tblocks/op\tpeak\n");
+	bench_eval("loop", NULL, "0 [dup 100000 <] [++] loop pop", 100000);
+	bench_eval("arith", "0",
+		"100000 [dup 0 >] [1 rol 3 * 2 + 7 mod 1 rol --] loop pop", 100000);
+	bench_eval("fib",
+		"[dup 2 < [] [dup 1 - fib swp 2 - fib +] if] \"fib\" ;",
+		"20 fib pop", fib_calls(20));
+	bench_eval("shuffle", "1 2 3 4 5",
+		"20000 [dup 0 >] [-- 5 rol 4 cpy 0 drp -5 rol 3 rol -3 rol "
+		"0 cpy 1 drp] loop pop", 20000);
+	bench_eval("list", NULL,
+		"20000 [dup 0 >] [-- [1 2 3 4] [5 6 7 8] cat reverse pul pop "
+		"7 rev 7 wrp pop] loop pop", 20000);
+	bench_eval("dict", NULL,
+		"20000 [dup 0 >] [-- [1 2] \"tmp\" ; tmp pop pop \"tmp\" ~] loop pop",
+		20000);
+	bench_read("read-strings", make_strings(5000));
+	bench_read("read-program", make_program(2000));
+	return 0;
+}
@@ -27,6 +27,11 @@
 #include <setjmp.h>
 #include <string.h>
 
+#ifdef LF_THREADS
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 struct lf_obj
 {
 	lf_type type;
@@ -39,6 +44,14 @@ struct lf_obj
 #define ntv(o) ((o)->ref->ntv.val)
 #define str(o) ((o)->ref->str.val)
 #define obj(o) ((o)->ref->obj.val)
+#define map(o) ((o)->ref->map.val)
+#define arr(o) ((o)->ref->arr.val)
+#define buf(o) ((o)->ref->buf.val)
+#define seq(o) ((o)->ref->seq.val)
+#define bld(o) ((o)->ref->bld.val)
+#define cor(o) ((o)->ref->cor.val)
+#define chn(o) ((o)->ref->chn.val)
+#define hash(o) ((o)->ref->obj.hash) /* shared by 'obj' and 'str' refs */
 
 struct lf_chk
 {
@@ -47,42 +60,207 @@ struct lf_chk
 	lf_chk* next;  /* next chunk */
 };
 
+typedef struct lf_frm lf_frm;
+
+/*
+ * Frame of evaluation. Frame of chunk borrows its elements ('list' is NULL),
+ * frame of shared list holds reference to list and walks its elements by
+ * 'code', frame of unique list ('code' is NULL) takes elements from list.
+ */
+struct lf_frm
+{
+	lf_obj* code; /* next element */
+	lf_obj* list; /* evaluated list */
+	lf_frm* next; /* caller frame */
+};
+
+typedef struct lf_cor lf_cor;
+
+/* State of evaluation, saved by coroutine while it isn't running */
+struct lf_cor
+{
+	lf_obj* stck; /* stack */
+	lf_frm* frms; /* evaluation frames, NULL if coroutine is finished */
+	lf_int size;  /* stack size */
+};
+
+#define COR_IDLE ((unsigned)-1) /* 'nest' of coroutine that isn't running */
+
+typedef struct lf_node lf_node;
+
+struct lf_node
+{
+	lf_obj* key; /* key, 'next' of key is value */
+	lf_node* lt; /* keys with less hash */
+	lf_node* ge; /* keys with greater or same hash */
+};
+
+typedef struct lf_buf lf_buf;
+
+struct lf_buf
+{
+	char* dat;     /* first element */
+	lf_obj* base;  /* userdata that owns memory */
+	unsigned type; /* type of elements */
+};
+
+typedef struct lf_sbld lf_sbld;
+
+struct lf_sbld
+{
+	lf_str* head;  /* first chunk */
+	lf_str* tail;  /* last chunk */
+	unsigned fill; /* count of characters in last chunk */
+};
+
+typedef union lf_seq lf_seq;
+
+union lf_seq
+{
+	struct { lf_num cur; lf_num end; } rng;            /* range */
+	struct { lf_obj* src; lf_obj* fn; lf_int n; } stg; /* stage */
+};
+
+enum { SEQ_RANGE, SEQ_MAP, SEQ_FILTER, SEQ_TAKE }; /* kinds of sequences */
+
 union lf_ref
 {
 	unsigned cnt; /* count of references */
-	struct { unsigned cnt; lf_obj* val; } obj;
+	struct { unsigned cnt; unsigned hash; lf_obj* val; } obj;
 	struct { unsigned cnt; lf_num  val; } num;
 	struct { unsigned cnt; lf_ntv  val; } ntv;
-	struct { unsigned cnt; lf_str* val; } str;
+	struct { unsigned cnt; unsigned hash; lf_str* val; } str;
 	struct { unsigned cnt; void* dat; lf_fin fin; } usr;
+	struct { unsigned cnt; unsigned len; lf_node* val; } map;
+	struct { unsigned cnt; unsigned len : 27, depth : 5; void* val; } arr;
+	struct { unsigned cnt; unsigned len; lf_buf* val; } buf;
+	struct { unsigned cnt; unsigned kind; lf_seq* val; } seq;
+	struct { unsigned cnt; unsigned len; lf_sbld* val; } bld;
+	struct { unsigned cnt; unsigned nest; lf_cor* val; } cor;
+	struct { unsigned cnt; lf_chan* val; } chn;
 };
 
+#define FROZEN ((unsigned)-1) /* 'cnt' of object from frozen dictionary */
+
+#define unref(o) do { \
+		if ((o)->ref->cnt != FROZEN) --(o)->ref->cnt; \
+	} while (0)
+
 struct lf_ctx
 {
 	lf_int 	size;         /* stack size */
 	lf_obj* stck;         /* stack */
 	lf_obj* dict;         /* dictionary */
+	lf_obj* base;         /* frozen part of dictionary */
 	lf_obj* free;         /* free stack */
+	unsigned long blocks; /* count of blocks given by lf_map_mem */
+	unsigned long nfree;  /* count of free blocks */
+	unsigned long lwm;    /* fewest free blocks since lf_mem_reset */
+	unsigned long allocs; /* count of allocations since lf_mem_reset */
+	unsigned long objs[LF_TCHN + 1]; /* live values of each type */
+	unsigned long strs;   /* count of string fragments */
+	unsigned long defs;   /* count of definitions */
+	unsigned long bdefs;  /* count of frozen definitions */
+	lf_int depth;         /* largest stack size since lf_mem_reset */
 	lf_obj* hold;         /* hold objects (used by lf_take) */
+	unsigned dver;        /* dictionary version (changed by lf_reg, lf_rem) */
+	lf_frm* frms;         /* evaluation frames */
+	lf_obj* cors;         /* running coroutines, from current to first */
+	unsigned nest;        /* depth of evaluations called by natives */
+	unsigned slice;       /* steps between yields, zero if unlimited */
+	unsigned left;        /* steps left before yield */
+	void* wait;           /* handle of operation that context waits for */
 	lf_rdfn rdfn;         /* read function */
 	lf_wrfn wrfn;         /* write function */
-	void* wdat;           /* data used by write function */
+	lf_wrbuf wrbuf;       /* block write function, used instead of 'wrfn' */
+	void* wdat;           /* data used by write functions */
+	unsigned olen;        /* size of buffered output */
+	char obuf[LF_OBUF_SIZE]; /* output buffer */
 	jmp_buf sbuf;         /* signal jump buffer */
 	lf_hdl shdl[LF_SERR]; /* signal handlers */
+#ifdef LF_PROFILE
+	lf_prof* prof;        /* profiler, NULL if not profiled */
+#endif
+#ifdef LF_HOOKS
+	unsigned hmask;       /* events passed to hook */
+	lf_hook hook;         /* hook of events */
+#endif
 };
 
-const char lf_typenames[][4] = {"lst", "sym", "str", "ntv", "num", "usr"};
+const char lf_typenames[][4] =
+{
+	"lst", "sym", "str", "ntv", "num", "usr", "map", "arr", "vec", "buf", "seq",
+	"bld", "cor", "chn"
+};
+
+static const unsigned char buf_size[] =
+{
+	sizeof(unsigned char), sizeof(int), sizeof(lf_num), sizeof(double)
+};
+
+/* Natives made by reader from pairs of elements, see 'fuse' */
+static void fused_dup(lf_ctx* ctx);
+static void fused_over(lf_ctx* ctx);
+static void fused_swp(lf_ctx* ctx);
+static void fused_rotr(lf_ctx* ctx);
+static void fused_rotl(lf_ctx* ctx);
+static void fused_pop(lf_ctx* ctx);
+static void fused_nip(lf_ctx* ctx);
+static void fused_qut(lf_ctx* ctx);
+static void fused_inc(lf_ctx* ctx);
+static void fused_dec(lf_ctx* ctx);
+static void fused_cmp(lf_ctx* ctx);
 
+/* Names of fused natives can't be read as symbol, they are used by lf_dump */
 static const char* builtin_key[] =
 {
 	"rol", "cpy", "drp", "wrp", "pul", "apl", ";", "~", "?", "eq", "is", "rf",
-	"sz", "+", "-", "*", "/", "mod", "sgn"
+	"sz", "memo", "+", "-", "*", "/", "mod", "sgn", "map-new", "get", "put",
+	"del", "has", "keys", "arr-new", "arr-wrp", "arr-pul", "nth", "set", "len",
+	"slice", "push", "vec-new", "vec-wrp", "vec-pul", "sum", "min", "max",
+	"dot", "range", "map", "filter", "take", "each", "seq-pul", "fold",
+	"reverse", "cat", "sort", "str-cat", "str-len", "substr", "str-find",
+	"num>str", "sb-new", "sb-add", "sb-str", "spawn", "resume", "yield"
+#ifdef LF_THREADS
+	, "pmap", "send", "recv", "try-send", "try-recv"
+#endif
+	, "0 cpy", "1 cpy", "1 rol", "2 rol", "-2 rol", "0 drp", "1 drp", "0 wrp",
+	"1 +", "1 -", "- sgn"
 };
 
 static const lf_ntv builtin_val[] =
 {
 	lf_rol, lf_cpy, lf_drp, lf_wrp, lf_pul, lf_apl, lf_reg, lf_rem, lf_fnd,
-	lf_eq, lf_is, lf_rf, lf_sz, lf_add, lf_sub, lf_mul, lf_div, lf_mod, lf_sgn
+	lf_eq, lf_is, lf_rf, lf_sz, lf_memo, lf_add, lf_sub, lf_mul, lf_div, lf_mod,
+	lf_sgn, lf_push_map, lf_get, lf_put, lf_del, lf_has, lf_keys, lf_push_arr,
+	lf_awrp, lf_apul, lf_nth, lf_set, lf_len, lf_slc, lf_psh, lf_push_vec,
+	lf_vwrp, lf_vpul, lf_sum, lf_min, lf_max, lf_dot, lf_rng, lf_smap, lf_sflt,
+	lf_stak, lf_each, lf_spul, lf_fold, lf_lrev, lf_cat, lf_sort, lf_scat,
+	lf_slen, lf_ssub, lf_sfnd, lf_ntos, lf_push_bld, lf_badd, lf_bstr,
+	lf_spwn, lf_cres, lf_yld
+#ifdef LF_THREADS
+	, lf_pmap, lf_send, lf_recv, lf_tsnd, lf_trcv
+#endif
+	, fused_dup, fused_over, fused_swp, fused_rotr, fused_rotl, fused_pop,
+	fused_nip, fused_qut, fused_inc, fused_dec, fused_cmp
+};
+
+/* Pair of number 'arg' (or native 'pre') and native 'op' is fused to 'fn' */
+static const struct
+{
+	lf_ntv pre;
+	lf_num arg;
+	lf_ntv op;
+	lf_ntv fn;
+}
+fusions[] =
+{
+	{ NULL, 0, lf_cpy, fused_dup }, { NULL, 1, lf_cpy, fused_over },
+	{ NULL, 1, lf_rol, fused_swp }, { NULL, 2, lf_rol, fused_rotr },
+	{ NULL, -2, lf_rol, fused_rotl }, { NULL, 0, lf_drp, fused_pop },
+	{ NULL, 1, lf_drp, fused_nip }, { NULL, 0, lf_wrp, fused_qut },
+	{ NULL, 1, lf_add, fused_inc }, { NULL, 1, lf_sub, fused_dec },
+	{ lf_sub, 0, lf_sgn, fused_cmp }
 };
 
 static lf_ntv find_builtin(const char* str)
@@ -108,11 +286,40 @@ void lf_init(lf_ctx* ctx)
 	ctx->size = 0;
 	ctx->stck = NULL;
 	ctx->dict = NULL;
+	ctx->base = NULL;
 	ctx->free = NULL;
+	ctx->blocks = 0;
+	ctx->nfree = 0;
+	ctx->lwm = 0;
+	ctx->allocs = 0;
+	for (i = 0; i <= LF_TCHN; ++i)
+	{
+		ctx->objs[i] = 0;
+	}
+	ctx->strs = 0;
+	ctx->defs = 0;
+	ctx->bdefs = 0;
+	ctx->depth = 0;
 	ctx->rdfn = NULL;
 	ctx->wrfn = NULL;
+	ctx->wrbuf = NULL;
 	ctx->wdat = NULL;
+	ctx->olen = 0;
+#ifdef LF_PROFILE
+	ctx->prof = NULL;
+#endif
+#ifdef LF_HOOKS
+	ctx->hmask = 0;
+	ctx->hook = NULL;
+#endif
 	ctx->hold = NULL;
+	ctx->dver = 0;
+	ctx->frms = NULL;
+	ctx->cors = NULL;
+	ctx->nest = 0;
+	ctx->slice = 0;
+	ctx->left = 0;
+	ctx->wait = NULL;
 	for (i = 0; i < LF_SERR; ++i)
 	{
 		ctx->shdl[i] = lf_dfl_hdl;
@@ -120,19 +327,164 @@ void lf_init(lf_ctx* ctx)
 	lf_reset(ctx);
 }
 
+#ifdef LF_HOOKS
+static void emit(lf_ctx* ctx, lf_htype type, lf_ntv ntv, const void* ptr,
+	lf_sig sig, const char* msg);
+#define notify(ctx, type, ntv, ptr, sig, msg) do { \
+		if ((ctx)->hmask & (type)) \
+		{ \
+			emit((ctx), (type), (ntv), (ptr), (sig), (msg)); \
+		} \
+	} while (0)
+#else
+#define notify(ctx, type, ntv, ptr, sig, msg) do { } while (0)
+#endif
+
 #define free_block(ctx, blk) do { \
 		lf_obj* __o = (lf_obj*)(blk); \
+		notify((ctx), LF_HFREE, NULL, __o, LF_SOK, NULL); \
 		(__o)->next = (ctx)->free; \
 		(ctx)->free = __o; \
+		++(ctx)->nfree; \
 	} while (0)
 
 static void free_list(lf_ctx* ctx, lf_obj* obj);
+static lf_obj* free_obj(lf_ctx* ctx, lf_obj* obj);
+static void free_seq(lf_ctx* ctx, lf_obj* obj);
+static void free_str(lf_ctx* ctx, lf_str* str);
+static void free_node(lf_ctx* ctx, lf_node* node);
+static void free_tree(lf_ctx* ctx, void* node, unsigned depth, int objs);
+static void drop_frames(lf_ctx* ctx);
+static lf_frm* free_frame(lf_ctx* ctx, lf_frm* frm);
+
+#ifdef LF_PROFILE
+static void prof_call(lf_ctx* ctx, const lf_obj* sym);
+static void prof_enter(lf_ctx* ctx, const void* key);
+static void prof_leave(lf_ctx* ctx, const void* key);
+static void prof_alloc(lf_ctx* ctx);
+static void prof_drop(lf_ctx* ctx);
+#define profile(ctx, hook) do { if ((ctx)->prof != NULL) hook; } while (0)
+#else
+#define profile(ctx, hook) do { } while (0)
+#endif
+
+/*
+ * Arrays and vectors are trees of blocks. Inner nodes hold TREE_SPAN subtrees,
+ * leaves hold 'span' elements: TREE_SPAN objects or VEC_SPAN numbers. Depth of
+ * tree depends only on its length and is kept in reference next to length, so
+ * length shares its bits.
+ */
+
+#define TREE_SPAN (LF_BLOCK_SIZE / sizeof(void*))
+#define VEC_SPAN  (LF_BLOCK_SIZE / sizeof(lf_num))
+#define TREE_LEN_MAX ((1UL << 27) - 1) /* max length of array or vector */
+
+#define leaf_span(o) ((o)->type == LF_TARR ? TREE_SPAN : VEC_SPAN)
+
+static unsigned tree_depth(unsigned len, unsigned span)
+{
+	unsigned depth = 0;
+	unsigned long cap = span;
+	while (cap < len)
+	{
+		cap *= TREE_SPAN;
+		++depth;
+	}
+	return depth;
+}
+
+/* Get 'idx' leaf of tree */
+static void** tree_leaf(void* root, unsigned depth, unsigned idx)
+{
+	unsigned long span = 1;
+	unsigned i;
+	for (i = 0; i < depth; ++i)
+	{
+		span *= TREE_SPAN;
+	}
+	while (depth-- > 0)
+	{
+		span /= TREE_SPAN;
+		root = ((void**)root)[idx / span];
+		idx %= span;
+	}
+	return (void**)root;
+}
+
+#define arr_leaf(o, i) \
+	tree_leaf(arr(o), (o)->ref->arr.depth, (i))
+#define vec_leaf(o, i) ((lf_num*)arr_leaf(o, i))
+
+/*
+ * Cursor walks leaves in order and keeps slots of nodes on path from root, so
+ * next leaf is mostly reached without descent from root. Cursor with context
+ * makes missing nodes.
+ */
+
+#define TREE_DEPTH_MAX (sizeof(unsigned) * 8) /* span is at least 2 */
+
+typedef struct
+{
+	lf_ctx* ctx;
+	void** path[TREE_DEPTH_MAX + 1];
+	unsigned depth;
+	unsigned idx;
+} tree_cur;
+
+static void* make_block(lf_ctx* ctx);
+
+static void* cur_node(tree_cur* cur, unsigned i)
+{
+	if (*cur->path[i] == NULL && cur->ctx != NULL)
+	{
+		*cur->path[i] = make_block(cur->ctx);
+		memset(*cur->path[i], 0, LF_BLOCK_SIZE);
+	}
+	return *cur->path[i];
+}
+
+/* Set cursor to first leaf of tree */
+static void* tree_first(tree_cur* cur, lf_ctx* ctx, void** root,
+	unsigned depth)
+{
+	unsigned i;
+	cur->ctx = ctx;
+	cur->path[0] = root;
+	cur->depth = depth;
+	cur->idx = 0;
+	for (i = 0; i < depth; ++i)
+	{
+		cur->path[i + 1] = (void**)cur_node(cur, i);
+	}
+	return cur_node(cur, depth);
+}
+
+/* Move cursor to next leaf, tree must have it */
+static void* tree_next(tree_cur* cur)
+{
+	unsigned i = cur->depth;
+	unsigned k = ++cur->idx;
+	while (k % TREE_SPAN == 0)
+	{
+		k /= TREE_SPAN;
+		--i;
+	}
+	for (++cur->path[i]; i < cur->depth; ++i)
+	{
+		cur->path[i + 1] = (void**)cur_node(cur, i);
+	}
+	return cur_node(cur, cur->depth);
+}
+
+/* Leaf of vector that holds 'i' element, when elements are visited in order */
+#define vec_walk(c, o, i) ((lf_num*)((i) == 0 ? \
+	tree_first(c, NULL, &arr(o), (o)->ref->arr.depth) : tree_next(c)))
 
 static void free_ref(lf_ctx* ctx, lf_obj* obj)
 {
-	lf_str* str;
-	if (--obj->ref->cnt == 0)
+	if (obj->ref->cnt != FROZEN && --obj->ref->cnt == 0)
 	{
+		--ctx->objs[obj->type];
 		switch (obj->type)
 		{
 			case LF_TLST:
@@ -140,13 +492,7 @@ static void free_ref(lf_ctx* ctx, lf_obj* obj)
 				break;
 			case LF_TSYM:
 			case LF_TSTR:
-				str = str(obj);
-				while (str != NULL)
-				{
-					lf_str* next = str->next;
-					free_block(ctx, str);
-					str = next;
-				}
+				free_str(ctx, str(obj));
 				break;
 			case LF_TNTV:
 			case LF_TNUM:
@@ -154,6 +500,35 @@ static void free_ref(lf_ctx* ctx, lf_obj* obj)
 			case LF_TUSR:
 				usr(obj).fin(ctx, usr(obj).dat);
 				break;
+			case LF_TMAP:
+				free_node(ctx, map(obj));
+				break;
+			case LF_TARR:
+			case LF_TVEC:
+				free_tree(ctx, arr(obj), obj->ref->arr.depth,
+					obj->type == LF_TARR);
+				break;
+			case LF_TBUF:
+				free_obj(ctx, buf(obj)->base);
+				free_block(ctx, buf(obj));
+				break;
+			case LF_TSEQ:
+				free_seq(ctx, obj);
+				break;
+			case LF_TBLD:
+				free_str(ctx, bld(obj)->head);
+				free_block(ctx, bld(obj));
+				break;
+			case LF_TCOR:
+				free_list(ctx, cor(obj)->stck);
+				while (cor(obj)->frms != NULL)
+				{
+					cor(obj)->frms = free_frame(ctx, cor(obj)->frms);
+				}
+				free_block(ctx, cor(obj));
+				break;
+			case LF_TCHN: /* channel is owned by host */
+				break;
 		}
 		free_block(ctx, obj->ref);
 	}
@@ -180,9 +555,54 @@ static void free_list(lf_ctx* ctx, lf_obj* obj)
 	}
 }
 
+static void free_str(lf_ctx* ctx, lf_str* str)
+{
+	while (str != NULL)
+	{
+		lf_str* next = str->next;
+		free_block(ctx, str);
+		--ctx->strs;
+		str = next;
+	}
+}
+
+/* Free tree and, if 'objs' is set, objects in its leaves */
+static void free_tree(lf_ctx* ctx, void* node, unsigned depth, int objs)
+{
+	unsigned i;
+	if (node != NULL)
+	{
+		for (i = 0; i < TREE_SPAN; ++i)
+		{
+			if (depth > 0)
+			{
+				free_tree(ctx, ((void**)node)[i], depth - 1, objs);
+			}
+			else if (objs && ((lf_obj**)node)[i] != NULL)
+			{
+				free_obj(ctx, ((lf_obj**)node)[i]);
+			}
+		}
+		free_block(ctx, node);
+	}
+}
+
+static void free_node(lf_ctx* ctx, lf_node* node)
+{
+	while (node != NULL)
+	{
+		lf_node* ge = node->ge;
+		free_node(ctx, node->lt);
+		free_list(ctx, node->key);
+		free_block(ctx, node);
+		node = ge;
+	}
+}
+
 void lf_reset(lf_ctx* ctx)
 {
 	free_hold(ctx);
+	drop_frames(ctx);
 	if (setjmp(ctx->sbuf) != LF_SOK)
 	{
 		lf_hdl hdl = ctx->shdl[LF_SINIERR - 1];
@@ -200,32 +620,115 @@ void lf_cfg_io(lf_ctx* ctx, lf_rdfn rdfn, lf_wrfn wrfn, void* wdat)
 	ctx->wdat = wdat != NULL ? wdat : ctx->wdat;
 }
 
+void lf_cfg_wrbuf(lf_ctx* ctx, lf_wrbuf wrbuf)
+{
+	ctx->wrbuf = wrbuf;
+}
+
+#ifdef LF_HOOKS
+void lf_set_hook(lf_ctx* ctx, unsigned mask, lf_hook hook)
+{
+	ctx->hmask = hook != NULL ? mask : 0;
+	ctx->hook = hook;
+}
+
+/* Events are not passed while hook runs, so it can use API */
+static void emit(lf_ctx* ctx, lf_htype type, lf_ntv ntv, const void* ptr,
+	lf_sig sig, const char* msg)
+{
+	unsigned mask = ctx->hmask;
+	lf_event ev;
+	ev.type = type;
+	ev.ntv = ntv;
+	ev.ptr = ptr;
+	ev.sig = sig;
+	ev.msg = msg;
+	ctx->hmask = 0;
+	ctx->hook(ctx, &ev);
+	ctx->hmask = mask;
+}
+#endif
+
 void lf_map_mem(lf_ctx* ctx, void* mem, unsigned size)
 {
 	lf_obj* obj = (lf_obj*)mem;
 	while (obj < (lf_obj*)mem + size / LF_BLOCK_SIZE)
 	{
-		free_block(ctx, obj);
+		obj->next = ctx->free;
+		ctx->free = obj;
 		++obj;
 	}
+	ctx->blocks += size / LF_BLOCK_SIZE;
+	ctx->nfree += size / LF_BLOCK_SIZE;
+	ctx->lwm += size / LF_BLOCK_SIZE;
+}
+
+void lf_mem_stats(const lf_ctx* ctx, lf_stats* stats)
+{
+	unsigned i;
+	stats->blocks = ctx->blocks;
+	stats->free = ctx->nfree;
+	stats->peak = ctx->blocks - ctx->lwm;
+	stats->allocs = ctx->allocs;
+	for (i = 0; i <= LF_TCHN; ++i)
+	{
+		stats->objs[i] = ctx->objs[i];
+	}
+	stats->strs = ctx->strs;
+	stats->defs = ctx->defs;
+	stats->depth = ctx->depth;
+}
+
+void lf_mem_reset(lf_ctx* ctx)
+{
+	ctx->lwm = ctx->nfree;
+	ctx->allocs = 0;
+	ctx->depth = ctx->size;
 }
 
 /******************************************************************************
  * Signal handling and tracing
  *****************************************************************************/
 
+/* Output is buffered until flush point (end of trace or signal message) */
+static void flush_out(lf_ctx* ctx)
+{
+	unsigned i;
+	if (ctx->wrbuf != NULL)
+	{
+		ctx->wrbuf(ctx->wdat, ctx->obuf, ctx->olen);
+	}
+	else
+	{
+		for (i = 0; i < ctx->olen; ++i)
+		{
+			ctx->wrfn(ctx->wdat, ctx->obuf[i]);
+		}
+	}
+	ctx->olen = 0;
+}
+
+static void writech(lf_ctx* ctx, char c)
+{
+	if (ctx->olen == LF_OBUF_SIZE)
+	{
+		flush_out(ctx);
+	}
+	ctx->obuf[ctx->olen++] = c;
+}
+
 static void writestr(lf_ctx* ctx, const char* str)
 {
 	while (*str != '\0')
 	{
-		ctx->wrfn(ctx->wdat, *str);
+		writech(ctx, *str);
 		++str;
 	}
 }
 
 #define writeln(ctx, str) do { \
 		writestr((ctx), str); \
-		(ctx)->wrfn((ctx)->wdat, '\n'); \
+		writech((ctx), '\n'); \
 	} while (0)
 
 lf_sig lf_dfl_hdl(lf_ctx* ctx, lf_sig sig, const char* msg)
@@ -234,14 +737,168 @@ lf_sig lf_dfl_hdl(lf_ctx* ctx, lf_sig sig, const char* msg)
 	sprintf(buf, "signal(%i): ", sig);
 	writestr(ctx, buf);
 	writeln(ctx, msg);
+	flush_out(ctx);
 	return sig;
 }
 
+static void trace_obj(lf_ctx* ctx, lf_obj* obj);
+
+static double pow10i(unsigned n)
+{
+	static const double tab[] =
+	{
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12,
+		1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+	double r = 1;
+	while (n > 22)
+	{
+		r *= 1e22;
+		n -= 22;
+	}
+	return r * tab[n];
+}
+
+#define scale10(x, i) ((i) < 0 ? (x) / pow10i(-(i)) : (x) * pow10i(i))
+
+/*
+ * Write shortest representation of number that is read back to the same
+ * number. Number is rounded in double precision to growing count of digits,
+ * until number read from them is equal. Notation is as of "%g" with precision
+ * not less than 5 (so whole numbers below 100000 are written in full).
+ */
+static void format_num(char* buf, lf_num num)
+{
+	double x = num < 0 ? -(double)num : (double)num;
+	double y, r;
+	char dig[9];
+	unsigned long d;
+	int k, i, p;
+	if (num < 0 || (num == 0 && 1 / num < 0))
+	{
+		*buf++ = '-';
+	}
+	if (num != num || x == 0 || (x * 0.5 == x))
+	{
+		strcpy(buf, num != num ? "nan" : x == 0 ? "0" : "inf");
+		return;
+	}
+	k = (int)floor(log10(x));
+	for (p = 1; p <= 9; ++p)
+	{
+		/* Make 'y' to have 'p' digits before point, 'k' is exponent */
+		i = p - 1 - k;
+		y = scale10(x, i);
+		if (y < pow10i(p - 1))
+		{
+			--k;
+			y = scale10(x, i + 1);
+		}
+		else if (y >= pow10i(p))
+		{
+			++k;
+			y = scale10(x, i - 1);
+		}
+		i = p - 1 - k;
+		r = floor(y + 0.5);
+		if (r - y == 0.5 && fmod(r, 2) != 0)
+		{
+			r -= 1; /* tie is rounded to even */
+		}
+		y = r;
+		if (y >= pow10i(p))
+		{
+			++k;
+			--i;
+			y /= 10;
+		}
+		if ((lf_num)scale10(y, -i) == (lf_num)x)
+		{
+			break;
+		}
+	}
+	if (p > 9)
+	{
+		sprintf(buf, "%.*g", sizeof(lf_num) == sizeof(float) ? 9 : 17, x);
+		return;
+	}
+	for (d = (unsigned long)y, i = p; i-- > 0; d /= 10)
+	{
+		dig[i] = (char)('0' + d % 10);
+	}
+	if (k < -4 || k >= (p > 5 ? p : 5))
+	{
+		*buf++ = dig[0];
+		if (p > 1)
+		{
+			*buf++ = '.';
+			memcpy(buf, dig + 1, p - 1);
+			buf += p - 1;
+		}
+		*buf++ = 'e';
+		*buf++ = k < 0 ? '-' : '+';
+		k = k < 0 ? -k : k;
+		if (k >= 100)
+		{
+			*buf++ = (char)('0' + k / 100);
+		}
+		*buf++ = (char)('0' + k / 10 % 10);
+		*buf++ = (char)('0' + k % 10);
+	}
+	else if (k < 0)
+	{
+		*buf++ = '0';
+		*buf++ = '.';
+		for (i = -1; i > k; --i)
+		{
+			*buf++ = '0';
+		}
+		memcpy(buf, dig, p);
+		buf += p;
+	}
+	else
+	{
+		for (i = 0; i < p || i <= k; ++i)
+		{
+			if (i == k + 1)
+			{
+				*buf++ = '.';
+			}
+			*buf++ = i < p ? dig[i] : '0';
+		}
+	}
+	*buf = '\0';
+}
+
+static void trace_num(lf_ctx* ctx, lf_num num)
+{
+	char buf[32];
+	format_num(buf, num);
+	writestr(ctx, buf);
+}
+
+static int trace_node(lf_ctx* ctx, lf_node* node, int sep)
+{
+	while (node != NULL)
+	{
+		sep = trace_node(ctx, node->lt, sep);
+		if (sep)
+		{
+			writech(ctx, ' ');
+		}
+		trace_obj(ctx, node->key);
+		sep = 1;
+		node = node->ge;
+	}
+	return sep;
+}
+
 static void trace_obj(lf_ctx* ctx, lf_obj* obj)
 {
 	union
 	{
 		lf_str* str;
+		unsigned i;
 		char buf[32];
 	}
 	tmp;
@@ -251,9 +908,9 @@ next:
 		switch (obj->type)
 		{
 			case LF_TLST:
-				ctx->wrfn(ctx->wdat, '[');
+				writech(ctx, '[');
 				trace_obj(ctx, obj(obj));
-				ctx->wrfn(ctx->wdat, ']');
+				writech(ctx, ']');
 				break;
 			case LF_TSYM:
 				for (tmp.str = str(obj); tmp.str != NULL; tmp.str = tmp.str->next)
@@ -262,26 +919,73 @@ next:
 				}
 				break;
 			case LF_TSTR:
-				ctx->wrfn(ctx->wdat, '"');
+				writech(ctx, '"');
 				for (tmp.str = str(obj); tmp.str != NULL; tmp.str = tmp.str->next)
 				{
 					writestr(ctx, tmp.str->buf);
 				}
-				ctx->wrfn(ctx->wdat, '"');
+				writech(ctx, '"');
 				break;
 			case LF_TNUM:
-				sprintf(tmp.buf, "%.5g", num(obj));
-				writestr(ctx, tmp.buf);
+				trace_num(ctx, num(obj));
 				break;
 			case LF_TNTV:
 			case LF_TUSR:
 				sprintf(tmp.buf, "(%s: %p)", lf_typenames[obj->type], usr(obj).dat);
 				writestr(ctx, tmp.buf);
 				break;
+			case LF_TBUF:
+				sprintf(tmp.buf, "(buf: %p %u)", (void*)buf(obj)->dat,
+					obj->ref->buf.len);
+				writestr(ctx, tmp.buf);
+				break;
+			case LF_TSEQ:
+				sprintf(tmp.buf, "(seq: %p)", (void*)seq(obj));
+				writestr(ctx, tmp.buf);
+				break;
+			case LF_TCOR:
+				sprintf(tmp.buf, "(cor: %p)", (void*)cor(obj));
+				writestr(ctx, tmp.buf);
+				break;
+			case LF_TCHN:
+				sprintf(tmp.buf, "(chn: %p)", (void*)chn(obj));
+				writestr(ctx, tmp.buf);
+				break;
+			case LF_TBLD:
+				writestr(ctx, "(bld: \"");
+				for (tmp.str = bld(obj)->head; tmp.str != NULL; tmp.str = tmp.str->next)
+				{
+					writestr(ctx, tmp.str->buf);
+				}
+				writestr(ctx, "\")");
+				break;
+			case LF_TMAP:
+				writech(ctx, '{');
+				trace_node(ctx, map(obj), 0);
+				writech(ctx, '}');
+				break;
+			case LF_TARR:
+				writestr(ctx, "(arr:");
+				for (tmp.i = 0; tmp.i < obj->ref->arr.len; ++tmp.i)
+				{
+					writech(ctx, ' ');
+					trace_obj(ctx, (lf_obj*)arr_leaf(obj, tmp.i / TREE_SPAN)[tmp.i % TREE_SPAN]);
+				}
+				writech(ctx, ')');
+				break;
+			case LF_TVEC:
+				writestr(ctx, "(vec:");
+				for (tmp.i = 0; tmp.i < obj->ref->arr.len; ++tmp.i)
+				{
+					writech(ctx, ' ');
+					trace_num(ctx, vec_leaf(obj, tmp.i / VEC_SPAN)[tmp.i % VEC_SPAN]);
+				}
+				writech(ctx, ')');
+				break;
 		}
 		if (obj->next)
 		{
-			ctx->wrfn(ctx->wdat, ' ');
+			writech(ctx, ' ');
 			obj = obj->next;
 			goto next;
 		}
@@ -293,18 +997,23 @@ void lf_trace(lf_ctx* ctx)
 	if (ctx->stck != NULL)
 	{
 		trace_obj(ctx, ctx->stck);
-		ctx->wrfn(ctx->wdat, '\n');
+		writech(ctx, '\n');
 	}
 	else
 	{
 		writeln(ctx, "-empty-");
 	}
+	flush_out(ctx);
 }
 
 
 void lf_raise(lf_ctx* ctx, lf_sig sig, const char* msg)
 {
-	sig = ctx->shdl[sig - 1](ctx, sig, msg);
+	notify(ctx, LF_HSIGNAL, NULL, NULL, sig, msg);
+	if (sig <= LF_SERR) /* signals after LF_SERR have no handlers */
+	{
+		sig = ctx->shdl[sig - 1](ctx, sig, msg);
+	}
 	if (sig != LF_SOK)
 	{
 		free_hold(ctx);
@@ -314,7 +1023,7 @@ void lf_raise(lf_ctx* ctx, lf_sig sig, const char* msg)
 
 void lf_signal(lf_ctx* ctx, lf_sig sig, lf_hdl hdl)
 {
-	if (sig != LF_SOK)
+	if (sig != LF_SOK && sig <= LF_SERR)
 	{
 		ctx->shdl[sig - 1] = hdl;
 	}
@@ -333,23 +1042,44 @@ static void* make_block(lf_ctx* ctx)
 	}
 	block = ctx->free;
 	ctx->free = ctx->free->next;
+	if (--ctx->nfree < ctx->lwm)
+	{
+		ctx->lwm = ctx->nfree;
+	}
+	++ctx->allocs;
+	profile(ctx, prof_alloc(ctx));
+	notify(ctx, LF_HALLOC, NULL, block, LF_SOK, NULL);
 	return block;
 }
 
-static lf_obj* make_obj(lf_ctx* ctx)
+static lf_obj* make_obj(lf_ctx* ctx, lf_type type)
 {
 	lf_obj* obj = (lf_obj*)make_block(ctx);
+	obj->type = type;
 	obj->ref = (lf_ref*)make_block(ctx);
+	++ctx->objs[type];
 	obj->ref->cnt = 1;
+	obj->ref->obj.hash = 0;
 	return obj;
 }
 
-static lf_obj* make_ref(lf_ctx* ctx, const lf_obj* obj)
+static lf_obj* make_lst(lf_ctx* ctx, lf_obj* head)
 {
-	lf_obj* cpy = (lf_obj*)make_block(ctx);
-	cpy->type = obj->type;
+	lf_obj* list = make_obj(ctx, LF_TLST);
+	obj(list) = head;
+	list->next = NULL;
+	return list;
+}
+
+static lf_obj* make_ref(lf_ctx* ctx, const lf_obj* obj)
+{
+	lf_obj* cpy = (lf_obj*)make_block(ctx);
+	cpy->type = obj->type;
 	cpy->ref = obj->ref;
-	++cpy->ref->cnt;
+	if (cpy->ref->cnt != FROZEN)
+	{
+		++cpy->ref->cnt;
+	}
 	return cpy;
 }
 
@@ -370,6 +1100,7 @@ static lf_str* build_string(lf_ctx* ctx, const char* txt, unsigned len)
 	while (len > 0)
 	{
 		*tail = (lf_str*)make_block(ctx);
+		++ctx->strs;
 		n = len < LF_STRBUF_SIZE - 1 ? len : LF_STRBUF_SIZE - 1;
 		for (i = 0; i < n && txt[i] != '\0'; ++i)
 		{
@@ -384,20 +1115,161 @@ static lf_str* build_string(lf_ctx* ctx, const char* txt, unsigned len)
 	return head;
 }
 
+/* Get character at position 'i' of string 's' and advance, '\0' at end */
+static char str_getc(const lf_str** s, unsigned* i)
+{
+	while (*s != NULL && (*s)->buf[*i] == '\0')
+	{
+		*s = (*s)->next;
+		*i = 0;
+	}
+	return *s != NULL ? (*s)->buf[(*i)++] : '\0';
+}
+
+/* Compare strings by characters, fragmentation of strings not matters */
+static int strord(const lf_str* a, const lf_str* b)
+{
+	unsigned i = 0, j = 0;
+	unsigned char ca, cb;
+	do
+	{
+		ca = (unsigned char)str_getc(&a, &i);
+		cb = (unsigned char)str_getc(&b, &j);
+	}
+	while (ca == cb && ca != '\0');
+	return (int)ca - (int)cb;
+}
+
 static int streq(const lf_str* a, const lf_str* b)
 {
-	while (a != NULL && b != NULL)
+	return strord(a, b) == 0;
+}
+
+/*
+ * Structural hash (32-bit FNV-1a). Hashes of lists, symbols and strings are
+ * computed on first demand and cached in reference, zero means 'not yet
+ * computed'. Strings are hashed by characters, so fragmentation not matters.
+ */
+
+#define HASH_BASIS (2166136261u)
+#define HASH_PRIME (16777619u)
+
+static unsigned hash_bytes(unsigned h, const void* dat, unsigned len)
+{
+	const unsigned char* p = (const unsigned char*)dat;
+	while (len-- > 0)
 	{
-		if (strcmp(a->buf, b->buf) != 0)
-		{
-			return 0;
-		}
-		a = a->next;
-		b = b->next;
+		h = (h ^ *p++) * HASH_PRIME;
+	}
+	return h;
+}
+
+static unsigned hash_obj(const lf_obj* obj);
+static lf_node** find_node(lf_node** it, const lf_obj* key);
+static int objeq(const lf_obj* a, const lf_obj* b);
+
+/* Hash of map entries, not depends on order of entries */
+static unsigned hash_node(const lf_node* node)
+{
+	unsigned h = 0;
+	while (node != NULL)
+	{
+		h += (hash_obj(node->key) * HASH_PRIME) ^ hash_obj(node->key->next);
+		h += hash_node(node->lt);
+		node = node->ge;
+	}
+	return h;
+}
+
+/* Hash of first 'n' objects of sequence (all objects if 'n' is negative) */
+static unsigned hash_seq(const lf_obj* it, lf_int n)
+{
+	unsigned h = HASH_BASIS;
+	for (; it != NULL && n != 0; it = it->next, --n)
+	{
+		h = (h ^ it->type ^ hash_obj(it)) * HASH_PRIME;
+	}
+	return h != 0 ? h : 1;
+}
+
+static unsigned hash_obj(const lf_obj* obj)
+{
+	unsigned h = HASH_BASIS;
+	union
+	{
+		const lf_str* str;
+		unsigned i;
+		lf_num num;
+		lf_ntv ntv;
+	}
+	tmp;
+	switch (obj->type)
+	{
+		case LF_TLST:
+			if (hash(obj) == 0)
+			{
+				hash(obj) = hash_seq(obj(obj), -1);
+			}
+			return hash(obj);
+		case LF_TSYM:
+		case LF_TSTR:
+			if (hash(obj) == 0)
+			{
+				for (tmp.str = str(obj); tmp.str != NULL; tmp.str = tmp.str->next)
+				{
+					h = hash_bytes(h, tmp.str->buf, strlen(tmp.str->buf));
+				}
+				hash(obj) = h != 0 ? h : 1;
+			}
+			return hash(obj);
+		case LF_TNTV:
+			tmp.ntv = ntv(obj);
+			return hash_bytes(h, &tmp.ntv, sizeof(tmp.ntv));
+		case LF_TNUM:
+			tmp.num = num(obj) == 0.0 ? 0.0 : num(obj); /* -0 == +0 */
+			return hash_bytes(h, &tmp.num, sizeof(tmp.num));
+		case LF_TUSR:
+			return hash_bytes(h, &usr(obj).dat, sizeof(usr(obj).dat));
+		case LF_TMAP:
+			return hash_node(map(obj));
+		case LF_TARR:
+			for (tmp.i = 0; tmp.i < obj->ref->arr.len; ++tmp.i)
+			{
+				const lf_obj* it = (lf_obj*)arr_leaf(obj, tmp.i / TREE_SPAN)[tmp.i % TREE_SPAN];
+				h = (h ^ it->type ^ hash_obj(it)) * HASH_PRIME;
+			}
+			return h;
+		case LF_TVEC:
+			for (tmp.i = 0; tmp.i < obj->ref->arr.len; ++tmp.i)
+			{
+				lf_num n = vec_leaf(obj, tmp.i / VEC_SPAN)[tmp.i % VEC_SPAN];
+				n = n == 0.0 ? 0.0 : n;
+				h = hash_bytes(h, &n, sizeof(n));
+			}
+			return h;
+		case LF_TBUF:
+			h = hash_bytes(h, &buf(obj)->dat, sizeof(buf(obj)->dat));
+			return hash_bytes(h, &obj->ref->buf.len, sizeof(obj->ref->buf.len));
+		case LF_TSEQ:
+			return hash_bytes(h, &seq(obj), sizeof(seq(obj)));
+		case LF_TBLD:
+			return hash_bytes(h, &bld(obj), sizeof(bld(obj)));
+		case LF_TCOR:
+			return hash_bytes(h, &cor(obj), sizeof(cor(obj)));
+		case LF_TCHN:
+			return hash_bytes(h, &chn(obj), sizeof(chn(obj)));
 	}
-	return a == b;
+	return h;
 }
 
+#undef HASH_PRIME
+#undef HASH_BASIS
+
+static int subnode(const lf_node* node, const lf_obj* map);
+static lf_obj* detach(lf_ctx* ctx);
+static lf_obj* keep(lf_ctx* ctx, lf_int i);
+static int seq_next(lf_ctx* ctx, lf_obj* seq);
+
 static int objeq(const lf_obj* a, const lf_obj* b)
 {
 	if (a == b) return 1;
@@ -406,6 +1278,14 @@ static int objeq(const lf_obj* a, const lf_obj* b)
 		switch (a->type)
 		{
 			case LF_TLST:
+				if (a->ref == b->ref)
+				{
+					return 1;
+				}
+				if (hash_obj(a) != hash_obj(b))
+				{
+					return 0;
+				}
 				a = obj(a);
 				b = obj(b);
 				while (a != NULL && b != NULL)
@@ -420,6 +1300,14 @@ static int objeq(const lf_obj* a, const lf_obj* b)
 				return a == b;
 			case LF_TSYM:
 			case LF_TSTR:
+				if (a->ref == b->ref)
+				{
+					return 1;
+				}
+				if (hash_obj(a) != hash_obj(b))
+				{
+					return 0;
+				}
 				return streq(str(a), str(b));
 			case LF_TNTV:
 				return ntv(a) == ntv(b);
@@ -427,11 +1315,129 @@ static int objeq(const lf_obj* a, const lf_obj* b)
 				return num(a) == num(b);
 			case LF_TUSR:
 				return usr(a).dat == usr(b).dat;
+			case LF_TMAP:
+				if (a->ref == b->ref)
+				{
+					return 1;
+				}
+				if (a->ref->map.len != b->ref->map.len)
+				{
+					return 0;
+				}
+				return subnode(map(a), b);
+			case LF_TARR:
+			{
+				void** la = NULL;
+				void** lb = NULL;
+				unsigned i;
+				if (a->ref == b->ref)
+				{
+					return 1;
+				}
+				if (a->ref->arr.len != b->ref->arr.len)
+				{
+					return 0;
+				}
+				for (i = 0; i < a->ref->arr.len; ++i)
+				{
+					if (i % TREE_SPAN == 0)
+					{
+						la = arr_leaf(a, i / TREE_SPAN);
+						lb = arr_leaf(b, i / TREE_SPAN);
+					}
+					if (!objeq((lf_obj*)la[i % TREE_SPAN], (lf_obj*)lb[i % TREE_SPAN]))
+					{
+						return 0;
+					}
+				}
+				return 1;
+			}
+			case LF_TVEC:
+			{
+				lf_num* la = NULL;
+				lf_num* lb = NULL;
+				unsigned i;
+				if (a->ref == b->ref)
+				{
+					return 1;
+				}
+				if (a->ref->arr.len != b->ref->arr.len)
+				{
+					return 0;
+				}
+				for (i = 0; i < a->ref->arr.len; ++i)
+				{
+					if (i % VEC_SPAN == 0)
+					{
+						la = vec_leaf(a, i / VEC_SPAN);
+						lb = vec_leaf(b, i / VEC_SPAN);
+					}
+					if (la[i % VEC_SPAN] != lb[i % VEC_SPAN])
+					{
+						return 0;
+					}
+				}
+				return 1;
+			}
+			case LF_TBUF:
+				return buf(a)->dat == buf(b)->dat
+					&& buf(a)->type == buf(b)->type
+					&& a->ref->buf.len == b->ref->buf.len;
+			case LF_TSEQ:
+				return seq(a) == seq(b);
+			case LF_TBLD:
+				return bld(a) == bld(b);
+			case LF_TCOR:
+				return cor(a) == cor(b);
+			case LF_TCHN:
+				return chn(a) == chn(b);
 		}
 	}
 	return 0;
 }
 
+/* Find slot of node with 'key', or slot where such node must be inserted */
+static lf_node** find_node(lf_node** it, const lf_obj* key)
+{
+	unsigned h = hash_obj(key);
+	while (*it != NULL)
+	{
+		unsigned kh = hash_obj((*it)->key);
+		if (h < kh)
+		{
+			it = &(*it)->lt;
+		}
+		else if (h == kh && objeq((*it)->key, key))
+		{
+			break;
+		}
+		else
+		{
+			it = &(*it)->ge;
+		}
+	}
+	return it;
+}
+
+/* Check that each entry of 'node' is in 'map' */
+static int subnode(const lf_node* node, const lf_obj* map)
+{
+	while (node != NULL)
+	{
+		lf_node* it = *find_node(&map(map), node->key);
+		if (it == NULL || !objeq(it->key->next, node->key->next))
+		{
+			return 0;
+		}
+		if (!subnode(node->lt, map))
+		{
+			return 0;
+		}
+		node = node->ge;
+	}
+	return 1;
+}
+
 static lf_ref* search_entry(lf_chk* chk, lf_obj* obj)
 {
 	lf_obj* it;
@@ -449,13 +1455,99 @@ static lf_ref* search_entry(lf_chk* chk, lf_obj* obj)
 	return NULL;
 }
 
+/* Get native that fuses elements 'a' and 'b', NULL if they aren't fused */
+static lf_ntv find_fusion(const lf_obj* a, const lf_obj* b)
+{
+	unsigned i;
+	if (b->type == LF_TNTV)
+	{
+		for (i = 0; i < sizeof(fusions) / sizeof(fusions[0]); ++i)
+		{
+			if (fusions[i].op == ntv(b) && (fusions[i].pre != NULL ?
+				a->type == LF_TNTV && ntv(a) == fusions[i].pre :
+				a->type == LF_TNUM && num(a) == fusions[i].arg))
+			{
+				return fusions[i].fn;
+			}
+		}
+	}
+	return NULL;
+}
+
+/* Replace pairs of elements by fused natives, return new tail of list */
+static lf_obj** fuse(lf_ctx* ctx, lf_obj** it)
+{
+	lf_ntv fn;
+	while (*it != NULL)
+	{
+		if ((*it)->next != NULL && (fn = find_fusion(*it, (*it)->next)) != NULL)
+		{
+			lf_obj* obj = make_obj(ctx, LF_TNTV);
+			ntv(obj) = fn;
+			obj->next = (*it)->next->next;
+			free_obj(ctx, free_obj(ctx, *it));
+			*it = obj;
+		}
+		it = &(*it)->next;
+	}
+	return it;
+}
+
+/* Check that list has elements to fuse, its sublists may be data */
+static int fusable(const lf_obj* it)
+{
+	for (; it != NULL; it = it->next)
+	{
+		if (it->next != NULL && find_fusion(it, it->next) != NULL)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Replace fused natives of unique list by pairs of elements they came from */
+static void unfuse(lf_ctx* ctx, lf_obj* list)
+{
+	lf_obj** it;
+	lf_obj* pre;
+	unsigned i;
+	for (it = &obj(list); *it != NULL; it = &(*it)->next)
+	{
+		for (i = 0; i < sizeof(fusions) / sizeof(fusions[0]); ++i)
+		{
+			if ((*it)->type == LF_TNTV && ntv(*it) == fusions[i].fn)
+			{
+				if (fusions[i].pre != NULL)
+				{
+					pre = make_obj(ctx, LF_TNTV);
+					ntv(pre) = fusions[i].pre;
+				}
+				else
+				{
+					pre = make_obj(ctx, LF_TNUM);
+					num(pre) = fusions[i].arg;
+				}
+				ntv(*it) = fusions[i].op;
+				pre->next = *it;
+				*it = pre;
+				it = &pre->next;
+				break;
+			}
+		}
+	}
+}
+
 static void finish_chk(lf_ctx* ctx, lf_chk** chk)
 {
 	lf_chk* next = (*chk)->next;
-	lf_ref* ref = (lf_ref*)make_block(ctx);
+	lf_ref* ref;
 	lf_obj* list = (lf_obj*)*chk;
+	ref = (lf_ref*)make_block(ctx);
+	++ctx->objs[LF_TLST];
 	/* Init reference */
 	ref->cnt = 1;
+	ref->obj.hash = 0;
 	ref->obj.val = (*chk)->head;
 	/* Make valid list */
 	list->type = LF_TLST;
@@ -525,13 +1617,13 @@ next:
 			c = ctx->rdfn(rdat);
 			goto next;
 		case '"':
-			obj = make_obj(ctx);
-			obj->type = LF_TSTR;
+			obj = make_obj(ctx, LF_TSTR);
 			str(obj) = NULL;
 			tmp.read.spec.pstr = &str(obj);
 			do
 			{
 				*tmp.read.spec.pstr = (lf_str*)make_block(ctx);
+				++ctx->strs;
 				for (tmp.read.i = 0; tmp.read.i < LF_STRBUF_SIZE - 1; ++tmp.read.i)
 				{
 					c = ctx->rdfn(rdat);
@@ -553,7 +1645,6 @@ next:
 			c = ctx->rdfn(rdat);
 			break;
 		default:
-			obj = make_obj(ctx);
 			for (tmp.read.i = 0; !isdelim(c) && c != '\0'; ++tmp.read.i)
 			{
 				if (tmp.read.i >= LF_SYM_MAX_LEN - 1)
@@ -568,7 +1659,7 @@ next:
 			tmp.ntv = find_builtin(tmp.read.buf);
 			if (tmp.ntv != NULL)
 			{
-				obj->type = LF_TNTV;
+				obj = make_obj(ctx, LF_TNTV);
 				ntv(obj) = tmp.ntv;
 			}
 			else
@@ -576,12 +1667,12 @@ next:
 				tmp.read.num = strtod(tmp.read.buf, &tmp.read.spec.p);
 				if (tmp.read.spec.p == tmp.read.buf + tmp.read.i)
 				{
-					obj->type = LF_TNUM;
+					obj = make_obj(ctx, LF_TNUM);
 					num(obj) = tmp.read.num;
 				}
 				else
 				{
-					obj->type = LF_TSYM;
+					obj = make_obj(ctx, LF_TSYM);
 					str(obj) = build_string(ctx, tmp.read.buf, tmp.read.i);
 				}
 			}
@@ -612,6 +1703,10 @@ lf_sig lf_read(lf_ctx* ctx, lf_chk** chk, void* rdat)
 			*chk = make_chk(ctx, NULL);
 		}
 		read_text(ctx, chk, rdat);
+		if ((*chk)->next == NULL)
+		{
+			(*chk)->tail = fuse(ctx, &(*chk)->head);
+		}
 	}
 	return sig;
 }
@@ -637,21 +1732,33 @@ static void unknown_symbol(lf_ctx* ctx, lf_str* str)
 	lf_raise(ctx, LF_SRUNERR, buf);
 }
 
-static lf_obj* find(lf_ctx* ctx, lf_str* str)
+/* Value of symbol, NULL if it isn't defined */
+static lf_obj* lookup(lf_ctx* ctx, const lf_obj* sym)
 {
 	lf_obj* obj = ctx->dict;
+	unsigned h = hash_obj(sym);
 	while (obj != NULL)
 	{
-		if (streq(str(obj), str))
+		if (hash_obj(obj) == h && streq(str(obj), str(sym)))
 		{
 			return obj->next;
 		}
 		obj = obj->next->next;
 	}
-	unknown_symbol(ctx, str);
 	return NULL;
 }
 
+static lf_obj* find(lf_ctx* ctx, const lf_obj* sym)
+{
+	lf_obj* val = lookup(ctx, sym);
+	if (val == NULL)
+	{
+		unknown_symbol(ctx, str(sym));
+	}
+	notify(ctx, LF_HFIND, NULL, sym, LF_SOK, NULL);
+	return val;
+}
+
 static lf_obj* make_cpy(lf_ctx* ctx, const lf_obj* obj)
 {
 	lf_obj* cpy = NULL;
@@ -661,8 +1768,7 @@ static lf_obj* make_cpy(lf_ctx* ctx, const lf_obj* obj)
 		{
 			lf_obj** tail;
 			lf_obj* it = obj(obj);
-			cpy = make_obj(ctx);
-			cpy->type = obj->type;
+			cpy = make_obj(ctx, obj->type);
 			obj(cpy) = NULL; 
 			tail = &(obj(cpy));
 			while (it != NULL)
@@ -676,13 +1782,23 @@ static lf_obj* make_cpy(lf_ctx* ctx, const lf_obj* obj)
 		case LF_TSTR:
 		case LF_TSYM:
 		case LF_TUSR:
+		case LF_TMAP:
+		case LF_TARR:
+		case LF_TVEC:
+		case LF_TBUF:
+		case LF_TSEQ:
+		case LF_TBLD:
+		case LF_TCOR:
+		case LF_TCHN:
 			cpy = make_ref(ctx, obj); 
 			break;
 		case LF_TNTV:
+			cpy = make_obj(ctx, obj->type);
+			ntv(cpy) = ntv(obj);
+			break;
 		case LF_TNUM:
-			cpy = make_obj(ctx);
-			cpy->type = obj->type;
-			cpy->ref->usr = obj->ref->usr;
+			cpy = make_obj(ctx, obj->type);
+			num(cpy) = num(obj);
 			break;
 	}
 	cpy->next = NULL;
@@ -693,72 +1809,369 @@ static void push_obj(lf_ctx* ctx, lf_obj* obj)
 {
 	obj->next = ctx->stck;
 	ctx->stck = obj;
-	++ctx->size; 
+	if (++ctx->size > ctx->depth)
+	{
+		ctx->depth = ctx->size;
+	}
 }
 
 static void native_call(lf_ctx* ctx, lf_ntv fn)
 {
+	notify(ctx, LF_HCALL, fn, NULL, LF_SOK, NULL);
 	fn(ctx);
 	free_hold(ctx);
+	notify(ctx, LF_HRET, fn, NULL, LF_SOK, NULL);
+}
+
+static void push_frame(lf_ctx* ctx, lf_obj* code, lf_obj* list)
+{
+	lf_frm* frm = (lf_frm*)make_block(ctx);
+	frm->code = code;
+	frm->list = list;
+	frm->next = ctx->frms;
+	ctx->frms = frm;
+}
+
+static lf_frm* free_frame(lf_ctx* ctx, lf_frm* frm)
+{
+	lf_frm* next = frm->next;
+	profile(ctx, prof_leave(ctx, frm));
+	if (frm->list != NULL)
+	{
+		free_obj(ctx, frm->list);
+	}
+	free_block(ctx, frm);
+	return next;
+}
+
+#define pop_frame(ctx) ((ctx)->frms = free_frame(ctx, (ctx)->frms))
+
+/* Swap state of evaluation with state saved by coroutine */
+static void switch_cor(lf_ctx* ctx, lf_obj* cor)
+{
+	lf_cor tmp = *cor(cor);
+	cor(cor)->stck = ctx->stck;
+	cor(cor)->frms = ctx->frms;
+	cor(cor)->size = ctx->size;
+	ctx->stck = tmp.stck;
+	ctx->frms = tmp.frms;
+	ctx->size = tmp.size;
+}
+
+/* Return from current coroutine that is finished */
+static lf_obj* leave_cor(lf_ctx* ctx)
+{
+	lf_obj* cor = ctx->cors;
+	while (ctx->frms != NULL)
+	{
+		pop_frame(ctx);
+	}
+	free_list(ctx, ctx->stck);
+	ctx->stck = NULL;
+	ctx->size = 0;
+	switch_cor(ctx, cor);
+	ctx->cors = cor->next;
+	cor->ref->cor.nest = COR_IDLE;
+	return cor;
 }
 
-static void execute(lf_ctx* ctx, lf_obj* obj)
+static void drop_frames(lf_ctx* ctx)
 {
+	while (ctx->cors != NULL)
+	{
+		free_obj(ctx, leave_cor(ctx));
+	}
+	while (ctx->frms != NULL)
+	{
+		pop_frame(ctx);
+	}
+	ctx->nest = 0;
+	ctx->wait = NULL;
+	profile(ctx, prof_drop(ctx));
+}
+
+static void call_native(lf_ctx* ctx, lf_ntv fn);
+
+/* Apply object, list is evaluated by new frame */
+static void call(lf_ctx* ctx, lf_obj* obj)
+{
+	lf_obj* tmp;
+	lf_ntv fn;
 begin:
 	switch (obj->type)
 	{
-		case LF_TSYM:
-			obj = find(ctx, str(obj));
-			if (obj->type == LF_TLST)
+		case LF_TLST:
+			if (obj(obj) == NULL)
 			{
-				obj = obj(obj);
-				if (obj == NULL)
-				{
-					return;
-				}
-				while (obj->next != NULL)
-				{
-					execute(ctx, obj);
-					obj = obj->next;
-				}
+				free_obj(ctx, obj);
+				profile(ctx, prof_enter(ctx, NULL));
+			}
+			else if (obj->ref->cnt == 1) /* list haven't references? */
+			{
+				push_frame(ctx, NULL, obj);
+				profile(ctx, prof_enter(ctx, ctx->frms));
+			}
+			else
+			{
+				push_frame(ctx, obj(obj), obj);
+				profile(ctx, prof_enter(ctx, ctx->frms));
 			}
+			break;
+		case LF_TSYM:
+			tmp = find(ctx, obj);
+			profile(ctx, prof_call(ctx, obj));
+			free_obj(ctx, obj);
+			obj = make_ref(ctx, tmp);
 			goto begin;
 		case LF_TNTV:
-			native_call(ctx, ntv(obj));
+			fn = ntv(obj);
+			free_obj(ctx, obj);
+			/* Native is identified by its call */
+			profile(ctx, prof_enter(ctx, &fn));
+			call_native(ctx, fn);
+			profile(ctx, prof_leave(ctx, &fn));
 			break;
 		default:
-			push_obj(ctx, make_cpy(ctx, obj));
+			push_obj(ctx, obj);
+			profile(ctx, prof_enter(ctx, NULL));
 			break;
 	}
 }
 
-lf_sig lf_eval(lf_ctx* ctx, const lf_chk* chk)
+/* Call native, 'apl' and 'eq' are evaluated without nesting */
+static void call_native(lf_ctx* ctx, lf_ntv fn)
 {
-	lf_sig sig = (lf_sig)setjmp(ctx->sbuf);
-	if (sig == LF_SOK)
+	if (fn == lf_apl)
 	{
-		if (chk->next == NULL)
+		lf_obj* obj = lf_peek(ctx, 0);
+		ctx->stck = obj->next;
+		--ctx->size;
+		call(ctx, obj);
+	}
+	else if (fn == lf_eq)
+	{
+		lf_obj* a = lf_peek(ctx, 3);
+		lf_obj* b = ctx->stck->next->next;
+		lf_obj* t = ctx->stck->next;
+		lf_obj* e = ctx->stck;
+		int res = objeq(a, b);
+		ctx->stck = free_obj(ctx, free_obj(ctx, b));
+		ctx->size -= 4;
+		if (res)
 		{
-			lf_obj* obj = chk->head;
-			while (obj != NULL)
-			{
-				execute(ctx, obj);
-				obj = obj->next;
-			}
+			free_obj(ctx, e);
+			call(ctx, t);
 		}
 		else
 		{
-			lf_raise(ctx, LF_SUNFCHK, "unfinished chunk");
+			free_obj(ctx, t);
+			call(ctx, e);
 		}
 	}
-	return sig;
+	else
+	{
+		native_call(ctx, fn);
+	}
 }
 
-void lf_wipe(lf_ctx* ctx, lf_chk** chk)
+/*
+ * Push condition that works like '&t' or '&f' of lib.lf, but is made of
+ * natives only, so it doesn't need definitions: '[0 drp]' or '[1 drp]'.
+ */
+static void push_cond(lf_ctx* ctx, int cond)
 {
-	while (*chk != NULL)
-	{
-		lf_chk* next = (*chk)->next;
+	lf_push_ntv(ctx, cond ? fused_pop : fused_nip);
+	lf_push_num(ctx, 0);
+	lf_wrp(ctx);
+}
+
+/*
+ * Evaluate frames until frame 'base' is reached. Frame is removed before its
+ * last element is evaluated, so tail calls don't grow frames. Returns 1 if
+ * budget of steps is spent or context is suspended, evaluation can be
+ * continued by next call.
+ */
+static int run(lf_ctx* ctx, lf_frm* base)
+{
+	lf_frm* frm;
+	lf_obj* obj;
+	lf_obj* tmp;
+	lf_ntv fn;
+	while ((frm = ctx->frms) != base)
+	{
+		if (ctx->left == 0)
+		{
+			if ((ctx->slice != 0 || ctx->wait != NULL) && ctx->nest == 0)
+			{
+				return 1;
+			}
+			/* Unlimited or nested evaluation, yield at next chance */
+			ctx->left = ctx->slice != 0 ? 1 : (unsigned)-1;
+		}
+		--ctx->left;
+		profile(ctx, ++ctx->prof->steps);
+		if (frm->code == NULL) /* unique list, take element from it */
+		{
+			if (frm->list == NULL) /* end of coroutine */
+			{
+				push_obj(ctx, leave_cor(ctx));
+				push_cond(ctx, 0);
+				continue;
+			}
+			obj = obj(frm->list);
+			/* Symbol is found before it's taken, so error not loses it */
+			tmp = obj->type == LF_TSYM ? make_ref(ctx, find(ctx, obj)) : obj;
+			obj(frm->list) = obj->next;
+			if (obj->next == NULL)
+			{
+				pop_frame(ctx);
+			}
+			if (obj->type == LF_TSYM)
+			{
+				profile(ctx, prof_call(ctx, obj));
+				free_obj(ctx, obj);
+				call(ctx, tmp);
+			}
+			else if (obj->type == LF_TNTV)
+			{
+				call(ctx, obj);
+			}
+			else
+			{
+				push_obj(ctx, obj);
+			}
+			continue;
+		}
+		obj = frm->code;
+		frm->code = obj->next;
+		switch (obj->type)
+		{
+			case LF_TSYM:
+				tmp = make_ref(ctx, find(ctx, obj));
+				if (frm->code == NULL)
+				{
+					pop_frame(ctx);
+				}
+				profile(ctx, prof_call(ctx, obj));
+				call(ctx, tmp);
+				break;
+			case LF_TNTV:
+				fn = ntv(obj);
+				if (frm->code == NULL)
+				{
+					pop_frame(ctx);
+				}
+				call_native(ctx, fn);
+				break;
+			default:
+				/* Elements of chunk are copied, so chunk can be evaluated again */
+				tmp = frm->list != NULL ? make_ref(ctx, obj) : make_cpy(ctx, obj);
+				if (frm->code == NULL)
+				{
+					pop_frame(ctx);
+				}
+				push_obj(ctx, tmp);
+				break;
+		}
+	}
+	return 0;
+}
+
+/* Evaluate object until it returns, used by natives that call quotations */
+static void apply(lf_ctx* ctx, lf_obj* obj)
+{
+	lf_frm* base = ctx->frms;
+	++ctx->nest;
+	call(ctx, obj);
+	run(ctx, base);
+	--ctx->nest;
+}
+
+/* Evaluate chunk, or suspended frames if 'chk' is NULL */
+static lf_sig proceed(lf_ctx* ctx, const lf_chk* chk, unsigned steps)
+{
+	lf_sig sig = (lf_sig)setjmp(ctx->sbuf);
+	if (sig == LF_SOK)
+	{
+		if (ctx->wait != NULL)
+		{
+			return LF_SWAIT;
+		}
+		else if (chk != NULL && chk->next != NULL)
+		{
+			lf_raise(ctx, LF_SUNFCHK, "unfinished chunk");
+		}
+		else
+		{
+			int yield;
+			if (chk != NULL && chk->head != NULL)
+			{
+				push_frame(ctx, chk->head, NULL);
+			}
+			ctx->slice = steps;
+			ctx->left = steps;
+			yield = run(ctx, NULL);
+			if (ctx->wait != NULL)
+			{
+				return LF_SWAIT;
+			}
+			else if (yield)
+			{
+				return LF_SYIELD;
+			}
+		}
+	}
+	else
+	{
+		drop_frames(ctx);
+	}
+	return sig;
+}
+
+lf_sig lf_eval(lf_ctx* ctx, const lf_chk* chk)
+{
+	return proceed(ctx, chk, 0);
+}
+
+lf_sig lf_eval_budget(lf_ctx* ctx, const lf_chk* chk, unsigned steps)
+{
+	return proceed(ctx, chk, steps);
+}
+
+lf_sig lf_resume(lf_ctx* ctx)
+{
+	return proceed(ctx, NULL, ctx->slice);
+}
+
+void lf_suspend(lf_ctx* ctx, void* handle)
+{
+	if (handle == NULL || ctx->wait != NULL)
+	{
+		lf_raise(ctx, LF_SRUNERR, "invalid suspend");
+	}
+	else if (ctx->nest != 0)
+	{
+		lf_raise(ctx, LF_SRUNERR, "suspend from nested evaluation");
+	}
+	ctx->wait = handle;
+	ctx->left = 0;
+}
+
+lf_sig lf_complete(lf_ctx* ctx, void* handle)
+{
+	if (handle == NULL || handle != ctx->wait)
+	{
+		return LF_SERR;
+	}
+	ctx->wait = NULL;
+	return proceed(ctx, NULL, ctx->slice);
+}
+
+void lf_wipe(lf_ctx* ctx, lf_chk** chk)
+{
+	while (*chk != NULL)
+	{
+		lf_chk* next = (*chk)->next;
 		free_list(ctx, (*chk)->head);
 		free_block(ctx, *chk);
 		*chk = next;
@@ -769,18 +2182,30 @@ void lf_wipe(lf_ctx* ctx, lf_chk** chk)
  * API 
  *****************************************************************************/
 
-lf_obj* lf_peek(lf_ctx* ctx, lf_int i)
+/* Unchecked build trusts code to be valid, for example checked by lf_check */
+#ifdef LF_UNCHECKED
+#define valid_index(ctx, i) 1
+#else
+static int valid_index(lf_ctx* ctx, lf_int i)
 {
-	lf_obj* obj = ctx->stck;
 	if (i >= ctx->size || ctx->size == 0)
 	{
 		lf_raise(ctx, LF_SUNDFLW, "stack underflow");
+		return 0;
 	}
 	else if (i < 0)
 	{
 		lf_raise(ctx, LF_SOVRFLW, "stack overflow");
+		return 0;
 	}
-	else
+	return 1;
+}
+#endif
+
+lf_obj* lf_peek(lf_ctx* ctx, lf_int i)
+{
+	lf_obj* obj = ctx->stck;
+	if (valid_index(ctx, i))
 	{
 		while (i > 0)
 		{
@@ -795,15 +2220,7 @@ lf_obj* lf_take(lf_ctx* ctx, lf_int i)
 {
 	lf_obj* res = NULL;
 	lf_obj** obj = &ctx->stck;
-	if (i >= ctx->size || ctx->size == 0)
-	{
-		lf_raise(ctx, LF_SUNDFLW, "stack underflow");
-	}
-	else if (i < 0)
-	{
-		lf_raise(ctx, LF_SOVRFLW, "stack overflow");
-	}
-	else
+	if (valid_index(ctx, i))
 	{
 		while (i > 0)
 		{
@@ -824,6 +2241,13 @@ lf_obj* lf_next(const lf_obj* obj)
 	return obj != NULL ? obj->next : NULL;
 }
 
+#ifdef LF_UNCHECKED
+#define check_type(require) do { \
+		(void) ctx; \
+		(void) obj; \
+		(void) (require); \
+	} while (0)
+#else
 #define check_type(require) do { \
 		char buf[32]; \
 		if (obj->type != require) \
@@ -833,6 +2257,7 @@ lf_obj* lf_next(const lf_obj* obj)
 			lf_raise(ctx, LF_SRUNERR, buf); \
 		} \
 	} while (0)
+#endif
 
 lf_num lf_to_num(lf_ctx* ctx, const lf_obj* obj)
 {
@@ -864,15 +2289,19 @@ const lf_str* lf_to_str(lf_ctx* ctx, const lf_obj* obj)
 	return str(obj);
 }
 
+static void check_obj(lf_ctx* ctx, const lf_obj* obj, lf_type require)
+{
+	check_type(require);
+}
+
 #undef check_type
 
 /******************************************************************************
  * Generic stack operations
  *****************************************************************************/
 
-void lf_rol(lf_ctx* ctx)
+static void roll(lf_ctx* ctx, lf_int step)
 {
-	lf_int step = lf_to_num(ctx, lf_take(ctx, 0));
 	if (step < 0)
 	{
 		lf_obj* last = lf_peek(ctx, -step);
@@ -898,6 +2327,22 @@ void lf_rol(lf_ctx* ctx)
 	}
 }
 
+static void wrap(lf_ctx* ctx, lf_int idx)
+{
+	lf_obj* obj = lf_peek(ctx, idx);
+	lf_obj* list = make_obj(ctx, LF_TLST);
+	obj(list) = ctx->stck;
+	ctx->stck = obj->next;
+	obj->next = NULL;
+	push_obj(ctx, list);
+	ctx->size -= idx + 1;
+}
+
+void lf_rol(lf_ctx* ctx)
+{
+	roll(ctx, lf_to_num(ctx, lf_take(ctx, 0)));
+}
+
 void lf_cpy(lf_ctx* ctx)
 {
 	lf_int idx = lf_to_num(ctx, lf_take(ctx, 0));
@@ -911,17 +2356,47 @@ void lf_drp(lf_ctx* ctx)
 
 void lf_wrp(lf_ctx* ctx)
 {
-	lf_obj* obj;
-	lf_obj* list;
-	lf_int idx = (lf_int)lf_to_num(ctx, lf_take(ctx, 0));	
-	obj = lf_peek(ctx, idx);
-	list = make_obj(ctx);
-	list->type = LF_TLST;
-	obj(list) = ctx->stck;
-	ctx->stck = obj->next;
-	obj->next = NULL;
-	push_obj(ctx, list);
-	ctx->size -= idx + 1;
+	wrap(ctx, lf_to_num(ctx, lf_take(ctx, 0)));
+}
+
+static void fused_dup(lf_ctx* ctx)
+{
+	push_obj(ctx, make_cpy(ctx, lf_peek(ctx, 0)));
+}
+
+static void fused_over(lf_ctx* ctx)
+{
+	push_obj(ctx, make_cpy(ctx, lf_peek(ctx, 1)));
+}
+
+static void fused_swp(lf_ctx* ctx)
+{
+	roll(ctx, 1);
+}
+
+static void fused_rotr(lf_ctx* ctx)
+{
+	roll(ctx, 2);
+}
+
+static void fused_rotl(lf_ctx* ctx)
+{
+	roll(ctx, -2);
+}
+
+static void fused_pop(lf_ctx* ctx)
+{
+	lf_take(ctx, 0);
+}
+
+static void fused_nip(lf_ctx* ctx)
+{
+	lf_take(ctx, 1);
+}
+
+static void fused_qut(lf_ctx* ctx)
+{
+	wrap(ctx, 0);
 }
 
 void lf_pul(lf_ctx* ctx)
@@ -948,165 +2423,6 @@ void lf_pul(lf_ctx* ctx)
 	}
 }
 
-#define native_tail_call(ctx, fn) do { \
-		if (fn == lf_apl) \
-		{ \
-			obj = lf_peek(ctx, 0); \
-			ctx->stck = obj->next; \
-			--ctx->size; \
-			goto begin; \
-		} \
-		else if (fn == lf_eq) \
-		{ \
-			lf_obj* a = lf_peek(ctx, 3); \
-			lf_obj* b = ctx->stck->next->next; \
-			lf_obj* t = ctx->stck->next; \
-			lf_obj* e = ctx->stck; \
-			int res = objeq(a, b); \
-			ctx->stck = free_obj(ctx, free_obj(ctx, b)); \
-			ctx->size -= 4; \
-			if (res) \
-			{ \
-				free_obj(ctx, e); \
-				obj = t; \
-				goto begin; \
-			} \
-			else \
-			{ \
-				free_obj(ctx, t); \
-				obj = e; \
-				goto begin; \
-			} \
-		} \
-		else \
-		{ \
-			native_call(ctx, fn); \
-		} \
-	} while (0)
-
-static void apply(lf_ctx* ctx, lf_obj* obj)
-{
-	lf_obj* tmp;
-	lf_ntv fn;
-begin:
-	switch (obj->type)
-	{
-		case LF_TLST:
-			tmp = obj(obj);
-			if (--obj->ref->cnt == 0) /* list haven't references? */
-			{
-				free_block(ctx, obj->ref);
-				free_block(ctx, obj);
-				if (tmp != NULL)
-				{
-					/* Apply without tail return */
-					while (tmp->next != NULL)
-					{
-						switch (tmp->type)
-						{
-							case LF_TSYM:
-								obj = find(ctx, str(tmp));
-								tmp = free_obj(ctx, tmp);
-								apply(ctx, make_ref(ctx, obj));
-								break;
-							case LF_TNTV:
-								fn = ntv(tmp);
-								tmp = free_obj(ctx, tmp);
-								native_call(ctx, fn);
-								break;
-							default:
-								obj = tmp;
-								tmp = tmp->next;
-								push_obj(ctx, obj);
-								break;
-						}
-					}
-					/* Apply with tail return */
-					switch (tmp->type)
-					{
-						case LF_TSYM:
-							obj = find(ctx, str(tmp));
-							free_obj(ctx, tmp);
-							obj = make_ref(ctx, obj);
-							goto begin;
-						case LF_TNTV:
-							fn = ntv(tmp);
-							free_obj(ctx, tmp);
-							native_tail_call(ctx, fn);
-							break;
-						default:
-							obj = tmp;
-							tmp = tmp->next;
-							push_obj(ctx, obj);
-							break;
-					}
-				}
-			}
-			else /* list not unique */
-			{
-				free_block(ctx, obj);
-				if (tmp != NULL)
-				{
-					/* Apply without tail return */
-					while (tmp->next != NULL)
-					{
-						switch (tmp->type)
-						{
-							case LF_TSYM:
-								obj = find(ctx, str(tmp));
-								tmp = tmp->next;
-								apply(ctx, make_ref(ctx, obj));
-								break;
-							case LF_TNTV:
-								fn = ntv(tmp);
-								tmp = tmp->next;
-								native_call(ctx, fn);
-								break;
-							default:
-								obj = make_ref(ctx, tmp);
-								tmp = tmp->next;
-								push_obj(ctx, obj);
-								break;
-						}
-					}
-					/* Apply with tail return */
-					switch (tmp->type)
-					{
-						case LF_TSYM:
-							obj = find(ctx, str(tmp));
-							obj = make_ref(ctx, obj);
-							goto begin;
-						case LF_TNTV:
-							fn = ntv(tmp);
-							native_tail_call(ctx, fn);
-							break;
-						default:
-							obj = make_ref(ctx, tmp);
-							tmp = tmp->next;
-							push_obj(ctx, obj);
-							break;
-					}
-				}
-			}
-			break;
-		case LF_TSYM:
-			tmp = find(ctx, str(obj));
-			free_obj(ctx, obj);
-			obj = make_ref(ctx, tmp);
-			goto begin;
-		case LF_TNTV:
-			fn = ntv(obj);
-			free_obj(ctx, obj);
-			native_tail_call(ctx, fn);
-			break;
-		default:
-			push_obj(ctx, obj);
-			break;
-	}
-}
-
-#undef native_tail_call
-
 void lf_apl(lf_ctx* ctx)
 {
 	lf_obj* obj = lf_peek(ctx, 0);
@@ -1119,54 +2435,183 @@ void lf_apl(lf_ctx* ctx)
  * Dictionary operations
  *****************************************************************************/
 
-void lf_reg(lf_ctx* ctx)
-{
-	lf_obj* name = ctx->stck;
-	lf_obj* value = lf_peek(ctx, 1);
-	lf_to_str(ctx, name);
-	ctx->stck = value->next;
-	value->next = ctx->dict;
-	ctx->dict = name;
-	ctx->size -= 2;
-}
+static void freeze_obj(lf_obj* obj);
+static void freeze_memo(lf_obj* obj);
 
-void lf_rem(lf_ctx* ctx)
+static void freeze_tree(void* node, unsigned depth)
 {
-	lf_obj* obj = lf_take(ctx, 0);
-	if (obj->type == LF_TSTR)
+	unsigned i;
+	if (node != NULL)
 	{
-		lf_obj** it = &ctx->dict;
-		while (*it != NULL)
+		for (i = 0; i < TREE_SPAN; ++i)
 		{
-			if (streq(str(*it), str(obj)))
+			if (depth > 0)
 			{
-				*it = free_obj(ctx, free_obj(ctx, *it));
-				break;
+				freeze_tree(((void**)node)[i], depth - 1);
+			}
+			else if (((lf_obj**)node)[i] != NULL)
+			{
+				freeze_obj(((lf_obj**)node)[i]);
 			}
-			it = &(*it)->next->next;
 		}
 	}
-	else
-	{
-		char buf[32];
-		sprintf(buf, "expected str, got %s", lf_typenames[obj->type]);
-		lf_raise(ctx, LF_SRUNERR, buf); 
-	}
 }
 
-void lf_fnd(lf_ctx* ctx)
+static void freeze_node(lf_node* node)
 {
-	lf_obj* obj = lf_take(ctx, 0);
-	lf_to_str(ctx, obj);
-	obj = find(ctx, str(obj));
-	push_obj(ctx, make_cpy(ctx, obj));
+	while (node != NULL)
+	{
+		freeze_node(node->lt);
+		freeze_obj(node->key);
+		freeze_obj(node->key->next);
+		node = node->ge;
+	}
 }
 
-/******************************************************************************
- * Special operations
- *****************************************************************************/
-
-void lf_eq(lf_ctx* ctx)
+/* Make object and objects reachable from it immutable and not counted */
+static void freeze_obj(lf_obj* obj)
+{
+	lf_obj* it;
+	if (obj->ref->cnt == FROZEN)
+	{
+		return;
+	}
+	switch (obj->type)
+	{
+		case LF_TLST:
+			for (it = obj(obj); it != NULL; it = it->next)
+			{
+				freeze_obj(it);
+			}
+			hash_obj(obj);
+			break;
+		case LF_TSYM:
+		case LF_TSTR:
+			hash_obj(obj);
+			break;
+		case LF_TMAP:
+			freeze_node(map(obj));
+			break;
+		case LF_TARR:
+			freeze_tree(arr(obj), obj->ref->arr.depth);
+			break;
+		case LF_TBUF:
+			freeze_obj(buf(obj)->base);
+			break;
+		case LF_TSEQ:
+			if (obj->ref->seq.kind != SEQ_RANGE)
+			{
+				freeze_obj(seq(obj)->stg.src);
+				if (seq(obj)->stg.fn != NULL)
+				{
+					freeze_obj(seq(obj)->stg.fn);
+				}
+			}
+			break;
+		case LF_TUSR:
+			freeze_memo(obj);
+			break;
+		default: /* other objects don't refer to objects */
+			break;
+	}
+	obj->ref->cnt = FROZEN;
+}
+
+void lf_freeze(lf_ctx* ctx)
+{
+	lf_obj* it;
+	for (it = ctx->dict; it != ctx->base; it = it->next->next)
+	{
+		freeze_obj(it);
+		freeze_obj(it->next);
+	}
+	ctx->base = ctx->dict;
+	ctx->bdefs = ctx->defs;
+}
+
+void lf_share(lf_ctx* ctx, const lf_ctx* img)
+{
+	lf_obj** it = &ctx->dict;
+	while (*it != ctx->base)
+	{
+		it = &(*it)->next->next;
+	}
+	*it = img->base;
+	ctx->base = img->base;
+	ctx->defs += img->bdefs - ctx->bdefs;
+	ctx->bdefs = img->bdefs;
+	++ctx->dver;
+}
+
+void lf_reg(lf_ctx* ctx)
+{
+	lf_obj* name = ctx->stck;
+	lf_obj* value = lf_peek(ctx, 1);
+	lf_to_str(ctx, name);
+	if (value->type == LF_TLST && fusable(obj(value)))
+	{
+		/*
+		 * Definition is evaluated as code, so its copy is fused. Sublists are
+		 * left as written, they may be data; '?' expands fused pairs back.
+		 */
+		lf_obj* cpy = make_cpy(ctx, value);
+		fuse(ctx, &obj(cpy));
+		free_ref(ctx, value);
+		value->ref = cpy->ref;
+		free_block(ctx, cpy);
+	}
+	ctx->stck = value->next;
+	value->next = ctx->dict;
+	ctx->dict = name;
+	ctx->size -= 2;
+	++ctx->defs;
+	++ctx->dver;
+}
+
+void lf_rem(lf_ctx* ctx)
+{
+	lf_obj* obj = lf_take(ctx, 0);
+	if (obj->type == LF_TSTR)
+	{
+		lf_obj** it = &ctx->dict;
+		unsigned h = hash_obj(obj);
+		while (*it != ctx->base) /* frozen definitions aren't removed */
+		{
+			if (hash_obj(*it) == h && streq(str(*it), str(obj)))
+			{
+				*it = free_obj(ctx, free_obj(ctx, *it));
+				--ctx->defs;
+				++ctx->dver;
+				break;
+			}
+			it = &(*it)->next->next;
+		}
+	}
+	else
+	{
+		char buf[32];
+		sprintf(buf, "expected str, got %s", lf_typenames[obj->type]);
+		lf_raise(ctx, LF_SRUNERR, buf); 
+	}
+}
+
+void lf_fnd(lf_ctx* ctx)
+{
+	lf_obj* obj = lf_take(ctx, 0);
+	lf_to_str(ctx, obj);
+	obj = make_cpy(ctx, find(ctx, obj));
+	push_obj(ctx, obj);
+	if (obj->type == LF_TLST)
+	{
+		unfuse(ctx, obj);
+	}
+}
+
+/******************************************************************************
+ * Special operations
+ *****************************************************************************/
+
+void lf_eq(lf_ctx* ctx)
 {
 	lf_obj* a = lf_peek(ctx, 3);
 	lf_obj* b = ctx->stck->next->next;
@@ -1177,129 +2622,4380 @@ void lf_eq(lf_ctx* ctx)
 	ctx->size -= 4;
 	if (res)
 	{
-		free_obj(ctx, e);
-		apply(ctx, t);
+		free_obj(ctx, e);
+		apply(ctx, t);
+	}
+	else
+	{
+		free_obj(ctx, t);
+		apply(ctx, e);
+	}
+}
+
+void lf_is(lf_ctx* ctx)
+{
+	lf_push_str(ctx, lf_typenames[lf_take(ctx, 0)->type], 3);
+}
+
+void lf_rf(lf_ctx* ctx)
+{
+	lf_int idx = lf_to_num(ctx, lf_take(ctx, 0));
+	push_obj(ctx, make_ref(ctx, lf_peek(ctx, idx)));
+}
+
+void lf_sz(lf_ctx* ctx)
+{
+	lf_push_num(ctx, ctx->size);
+}
+
+/*
+ * Memoized quotation is list '[<memo> arity <memo_call>]'. Cache is list of
+ * entries '[[args...] [results...]]' ordered from most to least recently
+ * used, arguments are stored in stack order and results in push order.
+ */
+
+typedef struct memo
+{
+	lf_obj* quot;  /* memoized quotation */
+	lf_obj* cache; /* cache entries */
+	unsigned dver; /* dictionary version of cache entries */
+}
+memo;
+
+static void memo_fin(lf_ctx* ctx, void* dat)
+{
+	memo* m = (memo*)dat;
+	free_obj(ctx, m->quot);
+	free_list(ctx, m->cache);
+	free_block(ctx, m);
+}
+
+/* Freeze quotation if userdata is memo, frozen memo doesn't use its cache */
+static void freeze_memo(lf_obj* obj)
+{
+	if (usr(obj).fin == memo_fin)
+	{
+		freeze_obj(((memo*)usr(obj).dat)->quot);
+	}
+}
+
+static void memo_call(lf_ctx* ctx)
+{
+	lf_obj** it;
+	lf_obj* obj;
+	lf_obj* res;
+	lf_obj* args;
+	memo* m;
+	unsigned h;
+	lf_int i, cnt, size;
+	lf_int n = (lf_int)lf_to_num(ctx, lf_peek(ctx, 0));
+	m = (memo*)lf_to_usr(ctx, lf_peek(ctx, 1));
+	lf_peek(ctx, n + 1);
+	ctx->stck = free_obj(ctx, ctx->stck);
+	--ctx->size;
+	/* Keep memo in frame, it must outlive quotation call */
+	if (keep(ctx, 0)->ref->cnt == FROZEN)
+	{
+		/* Frozen memo may be shared by contexts, so its cache isn't used */
+		apply(ctx, make_ref(ctx, m->quot));
+		pop_frame(ctx);
+		return;
+	}
+	args = ctx->stck;
+	if (m->dver != ctx->dver)
+	{
+		free_list(ctx, m->cache);
+		m->cache = NULL;
+		m->dver = ctx->dver;
+	}
+	/* Lookup */
+	h = hash_seq(args, n);
+	for (it = &m->cache; *it != NULL; it = &(*it)->next)
+	{
+		lf_obj* key = obj(*it);
+		if (hash_obj(key) == h)
+		{
+			lf_obj* a = args;
+			lf_obj* b = obj(key);
+			for (i = 0; i < n && objeq(a, b); ++i)
+			{
+				a = a->next;
+				b = b->next;
+			}
+			if (i == n)
+			{
+				/* Hit: move entry to front, replace arguments by results */
+				obj = *it;
+				*it = obj->next;
+				obj->next = m->cache;
+				m->cache = obj;
+				for (i = 0; i < n; ++i)
+				{
+					ctx->stck = free_obj(ctx, ctx->stck);
+				}
+				ctx->size -= n;
+				for (res = obj(obj(obj)->next); res != NULL; res = res->next)
+				{
+					push_obj(ctx, make_ref(ctx, res));
+				}
+				pop_frame(ctx);
+				return;
+			}
+		}
+	}
+	/* Miss: call quotation and remember results, arguments are kept in frame */
+	push_frame(ctx, NULL, NULL);
+	res = NULL;
+	for (i = 0, obj = args, it = &res; i < n; ++i, obj = obj->next)
+	{
+		*it = make_ref(ctx, obj);
+		it = &(*it)->next;
+	}
+	*it = NULL;
+	args = make_lst(ctx, res);
+	ctx->frms->list = args;
+	size = ctx->size - n;
+	apply(ctx, make_ref(ctx, m->quot));
+	if (ctx->size < size || m->dver != ctx->dver)
+	{
+		/* Quotation took more than its arity or changed dictionary */
+		pop_frame(ctx);
+		pop_frame(ctx);
+		return;
+	}
+	res = NULL;
+	for (i = size, obj = ctx->stck; i < ctx->size; ++i, obj = obj->next)
+	{
+		lf_obj* ref = make_ref(ctx, obj);
+		ref->next = res;
+		res = ref;
+	}
+	args->next = make_lst(ctx, res);
+	obj = make_lst(ctx, args);
+	ctx->frms->list = NULL;
+	pop_frame(ctx);
+	obj->next = m->cache;
+	m->cache = obj;
+	/* Evict least recently used entries */
+	for (it = &m->cache, cnt = 0; *it != NULL && cnt < LF_MEMO_SIZE; ++cnt)
+	{
+		it = &(*it)->next;
+	}
+	free_list(ctx, *it);
+	*it = NULL;
+	pop_frame(ctx);
+}
+
+void lf_memo(lf_ctx* ctx)
+{
+	memo* m;
+	lf_obj* quot;
+	lf_int n = (lf_int)lf_to_num(ctx, lf_take(ctx, 0));
+	quot = lf_take(ctx, 0);
+	if (n < 0)
+	{
+		lf_raise(ctx, LF_SRUNERR, "negative arity");
+	}
+	m = (memo*)make_block(ctx);
+	m->quot = make_ref(ctx, quot);
+	m->quot->next = NULL;
+	m->cache = NULL;
+	m->dver = ctx->dver;
+	lf_push_ntv(ctx, memo_call);
+	lf_push_num(ctx, n);
+	lf_push_usr(ctx, m, memo_fin);
+	lf_push_num(ctx, 2);
+	lf_wrp(ctx);
+}
+
+/******************************************************************************
+ * Map operations
+ *****************************************************************************/
+
+/*
+ * Map is binary search tree of nodes ordered by hash of keys. Hashes are
+ * well mixed, so tree is balanced on average without rebalancing. Map is
+ * shared by references and copied on write when it has several references.
+ */
+
+static void check_key(lf_ctx* ctx, const lf_obj* key)
+{
+	if (key->type != LF_TSTR && key->type != LF_TSYM && key->type != LF_TNUM)
+	{
+		char buf[32];
+		sprintf(buf, "expected key, got %s", lf_typenames[key->type]);
+		lf_raise(ctx, LF_SRUNERR, buf);
+	}
+}
+
+static lf_node* clone_node(lf_ctx* ctx, const lf_node* node)
+{
+	lf_node* cpy = NULL;
+	if (node != NULL)
+	{
+		cpy = (lf_node*)make_block(ctx);
+		cpy->lt = NULL;
+		cpy->ge = NULL;
+		cpy->key = make_ref(ctx, node->key);
+		cpy->key->next = make_ref(ctx, node->key->next);
+		cpy->key->next->next = NULL;
+		cpy->lt = clone_node(ctx, node->lt);
+		cpy->ge = clone_node(ctx, node->ge);
+	}
+	return cpy;
+}
+
+/* Make map unique before modification */
+static void own_map(lf_ctx* ctx, lf_obj* map)
+{
+	if (map->ref->cnt > 1)
+	{
+		lf_ref* ref = (lf_ref*)make_block(ctx);
+		++ctx->objs[LF_TMAP];
+		ref->cnt = 1;
+		ref->map.len = map->ref->map.len;
+		ref->map.val = clone_node(ctx, map(map));
+		unref(map);
+		map->ref = ref;
+	}
+}
+
+static lf_obj** collect_keys(lf_ctx* ctx, const lf_node* node, lf_obj** tail)
+{
+	while (node != NULL)
+	{
+		tail = collect_keys(ctx, node->lt, tail);
+		*tail = make_ref(ctx, node->key);
+		(*tail)->next = NULL;
+		tail = &(*tail)->next;
+		node = node->ge;
+	}
+	return tail;
+}
+
+void lf_get(lf_ctx* ctx)
+{
+	lf_node* node;
+	lf_obj* key = lf_take(ctx, 0);
+	lf_obj* map = lf_take(ctx, 0);
+	check_obj(ctx, map, LF_TMAP);
+	check_key(ctx, key);
+	node = *find_node(&map(map), key);
+	if (node == NULL)
+	{
+		lf_raise(ctx, LF_SRUNERR, "key not found");
+	}
+	push_obj(ctx, make_ref(ctx, node->key->next));
+}
+
+void lf_put(lf_ctx* ctx)
+{
+	lf_node** slot;
+	lf_node* node;
+	lf_obj* map = lf_peek(ctx, 2);
+	lf_obj* key = ctx->stck->next;
+	lf_obj* val = ctx->stck;
+	check_obj(ctx, map, LF_TMAP);
+	check_key(ctx, key);
+	own_map(ctx, map);
+	node = (lf_node*)make_block(ctx);
+	/* Move key and value from stack to map */
+	ctx->stck = map;
+	ctx->size -= 2;
+	val->next = NULL;
+	slot = find_node(&map(map), key);
+	if (*slot != NULL)
+	{
+		free_obj(ctx, (*slot)->key->next);
+		(*slot)->key->next = val;
+		free_obj(ctx, key);
+		free_block(ctx, node);
+	}
+	else
+	{
+		node->key = key;
+		node->key->next = val;
+		node->lt = NULL;
+		node->ge = NULL;
+		*slot = node;
+		++map->ref->map.len;
+	}
+}
+
+void lf_del(lf_ctx* ctx)
+{
+	lf_node** slot;
+	lf_obj* key = lf_take(ctx, 0);
+	lf_obj* map = lf_peek(ctx, 0);
+	check_obj(ctx, map, LF_TMAP);
+	check_key(ctx, key);
+	own_map(ctx, map);
+	slot = find_node(&map(map), key);
+	if (*slot != NULL)
+	{
+		lf_node* node = *slot;
+		if (node->lt == NULL)
+		{
+			*slot = node->ge;
+		}
+		else if (node->ge == NULL)
+		{
+			*slot = node->lt;
+		}
+		else
+		{
+			/* Replace by node with least key in 'ge' subtree */
+			lf_node** min = &node->ge;
+			while ((*min)->lt != NULL)
+			{
+				min = &(*min)->lt;
+			}
+			*slot = *min;
+			*min = (*min)->ge;
+			(*slot)->lt = node->lt;
+			(*slot)->ge = node->ge;
+		}
+		free_list(ctx, node->key);
+		free_block(ctx, node);
+		--map->ref->map.len;
+	}
+}
+
+void lf_has(lf_ctx* ctx)
+{
+	lf_obj* key = lf_take(ctx, 0);
+	lf_obj* map = lf_take(ctx, 0);
+	check_obj(ctx, map, LF_TMAP);
+	check_key(ctx, key);
+	push_cond(ctx, *find_node(&map(map), key) != NULL);
+}
+
+void lf_keys(lf_ctx* ctx)
+{
+	lf_obj* map = lf_take(ctx, 0);
+	lf_obj* list;
+	check_obj(ctx, map, LF_TMAP);
+	list = make_lst(ctx, NULL);
+	collect_keys(ctx, map(map), &obj(list));
+	push_obj(ctx, list);
+}
+
+/******************************************************************************
+ * Array and vector operations
+ *****************************************************************************/
+
+/* Get 'idx' leaf of tree, creating missing nodes */
+static void* make_leaf(lf_ctx* ctx, void** root, unsigned depth, unsigned idx)
+{
+	unsigned long span = 1;
+	unsigned i;
+	for (i = 0; i < depth; ++i)
+	{
+		span *= TREE_SPAN;
+	}
+	for (;;)
+	{
+		if (*root == NULL)
+		{
+			*root = make_block(ctx);
+			memset(*root, 0, LF_BLOCK_SIZE);
+		}
+		if (depth-- == 0)
+		{
+			return *root;
+		}
+		span /= TREE_SPAN;
+		root = &((void**)*root)[idx / span];
+		idx %= span;
+	}
+}
+
+/* Grow tree of array or vector to hold 'len' elements */
+static void grow_arr(lf_ctx* ctx, lf_obj* arr, unsigned len)
+{
+	unsigned depth = tree_depth(len, leaf_span(arr));
+	if (len > TREE_LEN_MAX)
+	{
+		lf_raise(ctx, LF_SRUNERR, "too many elements");
+	}
+	if (arr(arr) == NULL)
+	{
+		arr->ref->arr.depth = depth;
+	}
+	for (; arr->ref->arr.depth < depth; ++arr->ref->arr.depth)
+	{
+		void** node = (void**)make_block(ctx);
+		memset(node, 0, LF_BLOCK_SIZE);
+		node[0] = arr(arr);
+		arr(arr) = node;
+	}
+}
+
+static void* clone_tree(lf_ctx* ctx, void* node, unsigned depth, int objs)
+{
+	void** cpy = NULL;
+	unsigned i;
+	if (node != NULL)
+	{
+		cpy = (void**)make_block(ctx);
+		memset(cpy, 0, LF_BLOCK_SIZE);
+		if (depth == 0 && !objs)
+		{
+			memcpy(cpy, node, LF_BLOCK_SIZE);
+			return cpy;
+		}
+		for (i = 0; i < TREE_SPAN; ++i)
+		{
+			if (depth > 0)
+			{
+				cpy[i] = clone_tree(ctx, ((void**)node)[i], depth - 1, objs);
+			}
+			else if (((lf_obj**)node)[i] != NULL)
+			{
+				cpy[i] = make_ref(ctx, ((lf_obj**)node)[i]);
+				((lf_obj*)cpy[i])->next = NULL;
+			}
+		}
+	}
+	return cpy;
+}
+
+/* Make array or vector unique before modification */
+static void own_arr(lf_ctx* ctx, lf_obj* arr)
+{
+	if (arr->ref->cnt > 1)
+	{
+		lf_ref* ref = (lf_ref*)make_block(ctx);
+		++ctx->objs[arr->type];
+		ref->cnt = 1;
+		ref->arr.len = arr->ref->arr.len;
+		ref->arr.depth = arr->ref->arr.depth;
+		ref->arr.val = clone_tree(ctx, arr(arr), ref->arr.depth,
+			arr->type == LF_TARR);
+		unref(arr);
+		arr->ref = ref;
+	}
+}
+
+static lf_obj* make_arr(lf_ctx* ctx, lf_type type, unsigned len)
+{
+	lf_obj* arr;
+	if (len > TREE_LEN_MAX)
+	{
+		lf_raise(ctx, LF_SRUNERR, "too many elements");
+	}
+	arr = make_obj(ctx, type);
+	arr->ref->arr.len = len;
+	arr->ref->arr.depth = tree_depth(len, leaf_span(arr));
+	arr(arr) = NULL;
+	return arr;
+}
+
+static unsigned to_index(lf_ctx* ctx, const lf_obj* obj, unsigned len)
+{
+	lf_int idx;
+	check_obj(ctx, obj, LF_TNUM);
+	idx = (lf_int)num(obj);
+	if (idx < 0 || (unsigned)idx >= len)
+	{
+		lf_raise(ctx, LF_SRUNERR, "index out of range");
+	}
+	return (unsigned)idx;
+}
+
+/* Check that 'obj' is array or vector */
+static void check_arr(lf_ctx* ctx, const lf_obj* obj)
+{
+	if (obj->type != LF_TVEC)
+	{
+		check_obj(ctx, obj, LF_TARR);
+	}
+}
+
+static lf_num buf_at(const lf_obj* obj, unsigned i)
+{
+	const lf_buf* buf = buf(obj);
+	switch (buf->type)
+	{
+		case LF_BCHR:
+			return ((const unsigned char*)buf->dat)[i];
+		case LF_BINT:
+			return (lf_num)((const int*)buf->dat)[i];
+		case LF_BNUM:
+			return ((const lf_num*)buf->dat)[i];
+		default:
+			return (lf_num)((const double*)buf->dat)[i];
+	}
+}
+
+/* Get 'i' element of vector or buffer */
+static lf_num num_at(const lf_obj* obj, unsigned i)
+{
+	if (obj->type == LF_TBUF)
+	{
+		return buf_at(obj, i);
+	}
+	return vec_leaf(obj, i / VEC_SPAN)[i % VEC_SPAN];
+}
+
+/* Fold elements of buffer 'b' with expression 'e' on element 'x' */
+#define buf_fold(b, e) do { \
+		unsigned __i; \
+		unsigned __n = (b)->ref->buf.len; \
+		const char* __p = buf(b)->dat; \
+		switch (buf(b)->type) \
+		{ \
+			case LF_BCHR: \
+				for (__i = 0; __i < __n; ++__i) \
+				{ \
+					x = ((const unsigned char*)__p)[__i]; e; \
+				} \
+				break; \
+			case LF_BINT: \
+				for (__i = 0; __i < __n; ++__i) \
+				{ \
+					x = (lf_num)((const int*)__p)[__i]; e; \
+				} \
+				break; \
+			case LF_BNUM: \
+				for (__i = 0; __i < __n; ++__i) \
+				{ \
+					x = ((const lf_num*)__p)[__i]; e; \
+				} \
+				break; \
+			default: \
+				for (__i = 0; __i < __n; ++__i) \
+				{ \
+					x = (lf_num)((const double*)__p)[__i]; e; \
+				} \
+				break; \
+		} \
+	} while (0)
+
+void lf_awrp(lf_ctx* ctx)
+{
+	lf_obj** slot = NULL;
+	lf_obj* arr;
+	lf_obj* obj;
+	unsigned i, len, depth;
+	lf_int idx = (lf_int)lf_to_num(ctx, lf_take(ctx, 0));
+	lf_peek(ctx, idx);
+	len = idx + 1;
+	arr = make_arr(ctx, LF_TARR, len);
+	depth = arr->ref->arr.depth;
+	/* Build tree first, so running out of memory not loses elements */
+	for (i = 0; i < len; i += TREE_SPAN)
+	{
+		make_leaf(ctx, &arr(arr), depth, i / TREE_SPAN);
+	}
+	/* Move elements, top of stack is last element */
+	obj = ctx->stck;
+	for (i = len; i-- > 0;)
+	{
+		lf_obj* next = obj->next;
+		if (i == len - 1 || i % TREE_SPAN == TREE_SPAN - 1)
+		{
+			slot = (lf_obj**)make_leaf(ctx, &arr(arr), depth, i / TREE_SPAN);
+			slot += i % TREE_SPAN;
+		}
+		else
+		{
+			--slot;
+		}
+		obj->next = NULL;
+		*slot = obj;
+		obj = next;
+	}
+	ctx->stck = obj;
+	ctx->size -= len;
+	push_obj(ctx, arr);
+}
+
+void lf_apul(lf_ctx* ctx)
+{
+	lf_obj** leaf = NULL;
+	lf_obj* arr = lf_take(ctx, 0);
+	unsigned i;
+	check_obj(ctx, arr, LF_TARR);
+	for (i = 0; i < arr->ref->arr.len; ++i)
+	{
+		if (i % TREE_SPAN == 0)
+		{
+			leaf = (lf_obj**)arr_leaf(arr, i / TREE_SPAN);
+		}
+		if (arr->ref->cnt == 1) /* array is unique, move element */
+		{
+			push_obj(ctx, leaf[i % TREE_SPAN]);
+			leaf[i % TREE_SPAN] = NULL;
+		}
+		else
+		{
+			push_obj(ctx, make_ref(ctx, leaf[i % TREE_SPAN]));
+		}
+	}
+	lf_push_num(ctx, arr->ref->arr.len);
+}
+
+void lf_vwrp(lf_ctx* ctx)
+{
+	lf_num* leaf = NULL;
+	lf_obj* vec;
+	lf_obj* obj;
+	unsigned i, len, depth;
+	lf_int idx = (lf_int)lf_to_num(ctx, lf_take(ctx, 0));
+	lf_peek(ctx, idx);
+	len = idx + 1;
+	for (i = 0, obj = ctx->stck; i < len; ++i, obj = obj->next)
+	{
+		check_obj(ctx, obj, LF_TNUM);
+	}
+	vec = make_arr(ctx, LF_TVEC, len);
+	depth = vec->ref->arr.depth;
+	for (obj = ctx->stck, i = len; i-- > 0;)
+	{
+		if (i == len - 1 || i % VEC_SPAN == VEC_SPAN - 1)
+		{
+			leaf = (lf_num*)make_leaf(ctx, &arr(vec), depth, i / VEC_SPAN);
+		}
+		leaf[i % VEC_SPAN] = num(obj);
+		obj = free_obj(ctx, obj);
+	}
+	ctx->stck = obj;
+	ctx->size -= len;
+	push_obj(ctx, vec);
+}
+
+void lf_vpul(lf_ctx* ctx)
+{
+	lf_num* leaf = NULL;
+	lf_obj* vec = lf_take(ctx, 0);
+	unsigned i;
+	check_obj(ctx, vec, LF_TVEC);
+	for (i = 0; i < vec->ref->arr.len; ++i)
+	{
+		if (i % VEC_SPAN == 0)
+		{
+			leaf = vec_leaf(vec, i / VEC_SPAN);
+		}
+		lf_push_num(ctx, leaf[i % VEC_SPAN]);
+	}
+	lf_push_num(ctx, vec->ref->arr.len);
+}
+
+void lf_nth(lf_ctx* ctx)
+{
+	lf_obj* idx = lf_take(ctx, 0);
+	lf_obj* arr = lf_take(ctx, 0);
+	unsigned i;
+	if (arr->type == LF_TBUF)
+	{
+		i = to_index(ctx, idx, arr->ref->buf.len);
+		lf_push_num(ctx, buf_at(arr, i));
+		return;
+	}
+	check_arr(ctx, arr);
+	i = to_index(ctx, idx, arr->ref->arr.len);
+	if (arr->type == LF_TARR)
+	{
+		push_obj(ctx, make_ref(ctx, (lf_obj*)arr_leaf(arr, i / TREE_SPAN)[i % TREE_SPAN]));
+	}
+	else
+	{
+		lf_push_num(ctx, vec_leaf(arr, i / VEC_SPAN)[i % VEC_SPAN]);
+	}
+}
+
+void lf_set(lf_ctx* ctx)
+{
+	lf_obj** slot;
+	lf_obj* arr = lf_peek(ctx, 2);
+	lf_obj* idx = ctx->stck->next;
+	lf_obj* val = ctx->stck;
+	unsigned i;
+	check_arr(ctx, arr);
+	i = to_index(ctx, idx, arr->ref->arr.len);
+	if (arr->type == LF_TVEC)
+	{
+		check_obj(ctx, val, LF_TNUM);
+	}
+	own_arr(ctx, arr);
+	/* Move value from stack to array */
+	ctx->stck = arr;
+	ctx->size -= 2;
+	free_obj(ctx, idx);
+	if (arr->type == LF_TARR)
+	{
+		slot = (lf_obj**)arr_leaf(arr, i / TREE_SPAN) + i % TREE_SPAN;
+		free_obj(ctx, *slot);
+		val->next = NULL;
+		*slot = val;
+	}
+	else
+	{
+		vec_leaf(arr, i / VEC_SPAN)[i % VEC_SPAN] = num(val);
+		free_obj(ctx, val);
+	}
+}
+
+void lf_len(lf_ctx* ctx)
+{
+	lf_obj* obj = lf_take(ctx, 0);
+	lf_obj* it;
+	lf_int len = 0;
+	switch (obj->type)
+	{
+		case LF_TLST:
+			for (it = obj(obj); it != NULL; it = it->next)
+			{
+				++len;
+			}
+			break;
+		case LF_TMAP:
+			len = obj->ref->map.len;
+			break;
+		case LF_TARR:
+		case LF_TVEC:
+			len = obj->ref->arr.len;
+			break;
+		case LF_TBUF:
+			len = obj->ref->buf.len;
+			break;
+		default:
+		{
+			char buf[32];
+			sprintf(buf, "expected container, got %s", lf_typenames[obj->type]);
+			lf_raise(ctx, LF_SRUNERR, buf);
+			break;
+		}
+	}
+	lf_push_num(ctx, len);
+}
+
+void lf_slc(lf_ctx* ctx)
+{
+	void** src = NULL;
+	void** dst = NULL;
+	lf_obj* to = lf_take(ctx, 0);
+	lf_obj* from = lf_take(ctx, 0);
+	lf_obj* arr = lf_take(ctx, 0);
+	lf_obj* res;
+	unsigned i, j, k, span, depth;
+	if (arr->type == LF_TBUF)
+	{
+		lf_buf* buf;
+		j = to_index(ctx, to, arr->ref->buf.len + 1);
+		i = to_index(ctx, from, j + 1);
+		/* Slice shares memory and owner with original buffer */
+		buf = (lf_buf*)make_block(ctx);
+		buf->dat = buf(arr)->dat + i * buf_size[buf(arr)->type];
+		buf->type = buf(arr)->type;
+		buf->base = make_ref(ctx, buf(arr)->base);
+		buf->base->next = NULL;
+		res = make_obj(ctx, LF_TBUF);
+		res->ref->buf.len = j - i;
+		buf(res) = buf;
+		push_obj(ctx, res);
+		return;
+	}
+	check_arr(ctx, arr);
+	j = to_index(ctx, to, arr->ref->arr.len + 1);
+	i = to_index(ctx, from, j + 1);
+	span = leaf_span(arr);
+	res = make_arr(ctx, arr->type, j - i);
+	depth = res->ref->arr.depth;
+	for (k = 0; i < j; ++i, ++k)
+	{
+		if (k % span == 0)
+		{
+			dst = (void**)make_leaf(ctx, &arr(res), depth, k / span);
+		}
+		if (src == NULL || i % span == 0)
+		{
+			src = arr_leaf(arr, i / span);
+		}
+		if (arr->type == LF_TARR)
+		{
+			dst[k % span] = make_ref(ctx, (lf_obj*)src[i % span]);
+			((lf_obj*)dst[k % span])->next = NULL;
+		}
+		else
+		{
+			((lf_num*)dst)[k % span] = ((lf_num*)src)[i % span];
+		}
+	}
+	push_obj(ctx, res);
+}
+
+void lf_psh(lf_ctx* ctx)
+{
+	void** leaf;
+	lf_obj* arr = lf_peek(ctx, 1);
+	lf_obj* val = ctx->stck;
+	unsigned len, span;
+	check_arr(ctx, arr);
+	if (arr->type == LF_TVEC)
+	{
+		check_obj(ctx, val, LF_TNUM);
+	}
+	own_arr(ctx, arr);
+	len = arr->ref->arr.len;
+	span = leaf_span(arr);
+	grow_arr(ctx, arr, len + 1);
+	leaf = (void**)make_leaf(ctx, &arr(arr), arr->ref->arr.depth, len / span);
+	/* Move value from stack to array */
+	ctx->stck = arr;
+	--ctx->size;
+	if (arr->type == LF_TARR)
+	{
+		val->next = NULL;
+		leaf[len % span] = val;
+	}
+	else
+	{
+		((lf_num*)leaf)[len % span] = num(val);
+		free_obj(ctx, val);
+	}
+	++arr->ref->arr.len;
+}
+
+/*
+ * Vector kernels process whole leaves with plain loops over packed numbers,
+ * leaves of operands and result are walked by cursors. Operand with one
+ * element (number or vector) is broadcasted.
+ */
+
+#define VEC_VV 0 /* vector, vector */
+#define VEC_VS 1 /* vector, scalar */
+#define VEC_SV 2 /* scalar, vector */
+
+typedef void (*vec_fn)(lf_num* r, const lf_num* a, const lf_num* b,
+	unsigned n, int mode);
+
+#define vec_kernel(name, o) \
+	static void vec_##name(lf_num* r, const lf_num* a, const lf_num* b, \
+		unsigned n, int mode) \
+	{ \
+		unsigned i; \
+		switch (mode) \
+		{ \
+			case VEC_VV: \
+				for (i = 0; i < n; ++i) r[i] = a[i] o b[i]; \
+				break; \
+			case VEC_VS: \
+				for (i = 0; i < n; ++i) r[i] = a[i] o b[0]; \
+				break; \
+			default: \
+				for (i = 0; i < n; ++i) r[i] = a[0] o b[i]; \
+				break; \
+		} \
+	}
+
+vec_kernel(add, +)
+vec_kernel(sub, -)
+vec_kernel(mul, *)
+vec_kernel(div, /)
+
+#undef vec_kernel
+
+/* Apply kernel to two top elements, at least one of them is vector */
+static void vec_math(lf_ctx* ctx, vec_fn fn)
+{
+	tree_cur ca, cb, cr;
+	const lf_num* pa = NULL;
+	const lf_num* pb = NULL;
+	lf_num* pr;
+	lf_obj* b = ctx->stck;
+	lf_obj* a = b->next;
+	lf_obj* res;
+	unsigned i, len, la, lb, depth;
+	int mode;
+	if (a->type != LF_TVEC)
+	{
+		check_obj(ctx, a, LF_TNUM);
+	}
+	if (b->type != LF_TVEC)
+	{
+		check_obj(ctx, b, LF_TNUM);
+	}
+	la = a->type == LF_TVEC ? a->ref->arr.len : 1;
+	lb = b->type == LF_TVEC ? b->ref->arr.len : 1;
+	if (la != lb && la != 1 && lb != 1)
+	{
+		lf_raise(ctx, LF_SRUNERR, "vector length mismatch");
+	}
+	len = la == 1 ? lb : la;
+	mode = la == lb ? VEC_VV : lb == 1 ? VEC_VS : VEC_SV;
+	if (a->type == LF_TVEC && a->ref->cnt == 1 && la == len)
+	{
+		res = a; /* result in place of unique vector */
+	}
+	else
+	{
+		res = make_arr(ctx, LF_TVEC, len);
+	}
+	depth = res->ref->arr.depth;
+	if (la == 1)
+	{
+		pa = a->type == LF_TVEC ? vec_leaf(a, 0) : &num(a);
+	}
+	if (lb == 1)
+	{
+		pb = b->type == LF_TVEC ? vec_leaf(b, 0) : &num(b);
+	}
+	for (i = 0; i < len; i += VEC_SPAN)
+	{
+		if (la != 1)
+		{
+			pa = vec_walk(&ca, a, i);
+		}
+		if (lb != 1)
+		{
+			pb = vec_walk(&cb, b, i);
+		}
+		pr = (lf_num*)(i == 0 ? tree_first(&cr, ctx, &arr(res), depth) :
+			tree_next(&cr));
+		fn(pr, pa, pb, len - i < VEC_SPAN ? len - i : VEC_SPAN, mode);
+	}
+	ctx->stck = free_obj(ctx, b);
+	--ctx->size;
+	if (res != a)
+	{
+		ctx->stck = free_obj(ctx, a);
+		--ctx->size;
+		push_obj(ctx, res);
+	}
+}
+
+void lf_sum(lf_ctx* ctx)
+{
+	lf_obj* vec = lf_peek(ctx, 0);
+	tree_cur cur;
+	lf_num sum = 0.0;
+	lf_num x;
+	unsigned i, j, n;
+	if (vec->type == LF_TSEQ)
+	{
+		vec = keep(ctx, 0);
+		while (seq_next(ctx, vec))
+		{
+			sum += lf_to_num(ctx, lf_take(ctx, 0));
+		}
+		pop_frame(ctx);
+		lf_push_num(ctx, sum);
+		return;
+	}
+	vec = lf_take(ctx, 0);
+	if (vec->type == LF_TBUF)
+	{
+		buf_fold(vec, sum += x);
+		lf_push_num(ctx, sum);
+		return;
+	}
+	check_obj(ctx, vec, LF_TVEC);
+	for (i = 0; i < vec->ref->arr.len; i += VEC_SPAN)
+	{
+		const lf_num* p = vec_walk(&cur, vec, i);
+		n = vec->ref->arr.len - i < VEC_SPAN ? vec->ref->arr.len - i : VEC_SPAN;
+		for (j = 0; j < n; ++j)
+		{
+			sum += p[j];
+		}
+	}
+	lf_push_num(ctx, sum);
+}
+
+#define minmax(name, o) \
+	void lf_##name(lf_ctx* ctx) \
+	{ \
+		tree_cur cur; \
+		lf_num res, x; \
+		unsigned i, j, n; \
+		lf_obj* obj = lf_take(ctx, 0); \
+		if (obj->type == LF_TBUF) \
+		{ \
+			if (obj->ref->buf.len == 0) \
+			{ \
+				lf_raise(ctx, LF_SRUNERR, "empty buffer"); \
+			} \
+			res = buf_at(obj, 0); \
+			buf_fold(obj, res = x o res ? x : res); \
+		} \
+		else if (obj->type == LF_TVEC) \
+		{ \
+			if (obj->ref->arr.len == 0) \
+			{ \
+				lf_raise(ctx, LF_SRUNERR, "empty vector"); \
+			} \
+			res = vec_leaf(obj, 0)[0]; \
+			for (i = 0; i < obj->ref->arr.len; i += VEC_SPAN) \
+			{ \
+				const lf_num* p = vec_walk(&cur, obj, i); \
+				n = obj->ref->arr.len - i < VEC_SPAN ? \
+					obj->ref->arr.len - i : VEC_SPAN; \
+				for (j = 0; j < n; ++j) \
+				{ \
+					res = p[j] o res ? p[j] : res; \
+				} \
+			} \
+		} \
+		else \
+		{ \
+			lf_num a = lf_to_num(ctx, lf_take(ctx, 0)); \
+			lf_num b = lf_to_num(ctx, obj); \
+			res = a o b ? a : b; \
+		} \
+		lf_push_num(ctx, res); \
+	}
+
+minmax(min, <)
+minmax(max, >)
+
+#undef minmax
+
+void lf_dot(lf_ctx* ctx)
+{
+	lf_obj* b = lf_take(ctx, 0);
+	lf_obj* a = lf_take(ctx, 0);
+	tree_cur ca, cb;
+	lf_num sum = 0.0;
+	unsigned i, j, n, len;
+	if (a->type != LF_TBUF)
+	{
+		check_obj(ctx, a, LF_TVEC);
+	}
+	if (b->type != LF_TBUF)
+	{
+		check_obj(ctx, b, LF_TVEC);
+	}
+	len = a->type == LF_TBUF ? a->ref->buf.len : a->ref->arr.len;
+	if ((b->type == LF_TBUF ? b->ref->buf.len : b->ref->arr.len) != len)
+	{
+		lf_raise(ctx, LF_SRUNERR, "vector length mismatch");
+	}
+	if (a->type == LF_TBUF || b->type == LF_TBUF)
+	{
+		for (i = 0; i < len; ++i)
+		{
+			sum += num_at(a, i) * num_at(b, i);
+		}
+		lf_push_num(ctx, sum);
+		return;
+	}
+	for (i = 0; i < len; i += VEC_SPAN)
+	{
+		const lf_num* pa = vec_walk(&ca, a, i);
+		const lf_num* pb = vec_walk(&cb, b, i);
+		n = len - i < VEC_SPAN ? len - i : VEC_SPAN;
+		for (j = 0; j < n; ++j)
+		{
+			sum += pa[j] * pb[j];
+		}
+	}
+	lf_push_num(ctx, sum);
+}
+
+/******************************************************************************
+ * Sequence operations
+ *****************************************************************************/
+
+/*
+ * Sequence is chain of stages that ends with range. Elements are produced one
+ * by one when consumer pulls them, so stages don't build intermediate lists.
+ * Pulling changes state of stages, so sequence is copied on pull when it has
+ * several references. Consumers detach sequence from stack, because quotations
+ * called by stages may free held objects.
+ */
+
+static void free_seq(lf_ctx* ctx, lf_obj* obj)
+{
+	if (obj->ref->seq.kind != SEQ_RANGE)
+	{
+		free_obj(ctx, seq(obj)->stg.src);
+		if (seq(obj)->stg.fn != NULL)
+		{
+			free_obj(ctx, seq(obj)->stg.fn);
+		}
+	}
+	free_block(ctx, seq(obj));
+}
+
+/* Remove top element from stack without holding it */
+static lf_obj* detach(lf_ctx* ctx)
+{
+	lf_obj* obj = lf_peek(ctx, 0);
+	ctx->stck = obj->next;
+	obj->next = NULL;
+	--ctx->size;
+	return obj;
+}
+
+/*
+ * Move element 'i' of stack into frame which is never evaluated. Object stays
+ * reachable while native applies quotations and is freed by pop_frame, or by
+ * drop_frames if error unwinds evaluation.
+ */
+static lf_obj* keep(lf_ctx* ctx, lf_int i)
+{
+	lf_obj** it = &ctx->stck;
+	lf_obj* obj;
+	lf_peek(ctx, i);
+	push_frame(ctx, NULL, NULL);
+	while (i-- > 0)
+	{
+		it = &(*it)->next;
+	}
+	obj = *it;
+	*it = obj->next;
+	obj->next = NULL;
+	--ctx->size;
+	ctx->frms->list = obj;
+	return obj;
+}
+
+static lf_obj* make_seq(lf_ctx* ctx, unsigned kind)
+{
+	lf_obj* obj = make_obj(ctx, LF_TSEQ);
+	obj->ref->seq.kind = kind;
+	seq(obj) = (lf_seq*)make_block(ctx);
+	return obj;
+}
+
+static void own_seq(lf_ctx* ctx, lf_obj* seq)
+{
+	if (seq->ref->cnt > 1)
+	{
+		lf_ref* ref = (lf_ref*)make_block(ctx);
+		lf_seq* val = (lf_seq*)make_block(ctx);
+		*val = *seq(seq);
+		if (seq->ref->seq.kind != SEQ_RANGE)
+		{
+			val->stg.src = make_ref(ctx, val->stg.src);
+			val->stg.src->next = NULL;
+			if (val->stg.fn != NULL)
+			{
+				val->stg.fn = make_ref(ctx, val->stg.fn);
+				val->stg.fn->next = NULL;
+			}
+		}
+		ref->cnt = 1;
+		++ctx->objs[LF_TSEQ];
+		ref->seq.kind = seq->ref->seq.kind;
+		ref->seq.val = val;
+		unref(seq);
+		seq->ref = ref;
+	}
+}
+
+/* Pop result of condition: number or '&t', '&f' quotation */
+static int pop_cond(lf_ctx* ctx)
+{
+	lf_obj* res = lf_peek(ctx, 0);
+	if (res->type != LF_TNUM)
+	{
+		res = detach(ctx);
+		lf_push_num(ctx, 1);
+		lf_push_num(ctx, 0);
+		apply(ctx, res);
+	}
+	return lf_to_num(ctx, lf_take(ctx, 0)) != 0.0;
+}
+
+/* Push next element of sequence, return 0 if sequence is over */
+static int seq_next(lf_ctx* ctx, lf_obj* seq)
+{
+	lf_seq* val;
+	own_seq(ctx, seq);
+	val = seq(seq);
+	switch (seq->ref->seq.kind)
+	{
+		case SEQ_RANGE:
+			if (val->rng.cur < val->rng.end)
+			{
+				lf_push_num(ctx, val->rng.cur);
+				val->rng.cur += 1.0;
+				return 1;
+			}
+			return 0;
+		case SEQ_MAP:
+			if (seq_next(ctx, val->stg.src))
+			{
+				apply(ctx, make_ref(ctx, val->stg.fn));
+				return 1;
+			}
+			return 0;
+		case SEQ_FILTER:
+			while (seq_next(ctx, val->stg.src))
+			{
+				push_obj(ctx, make_ref(ctx, ctx->stck));
+				apply(ctx, make_ref(ctx, val->stg.fn));
+				if (pop_cond(ctx))
+				{
+					return 1;
+				}
+				lf_take(ctx, 0);
+			}
+			return 0;
+		default:
+			if (val->stg.n > 0 && seq_next(ctx, val->stg.src))
+			{
+				--val->stg.n;
+				return 1;
+			}
+			val->stg.n = 0;
+			return 0;
+	}
+}
+
+/* Make stage with source sequence and quotation or count */
+static void push_stage(lf_ctx* ctx, unsigned kind)
+{
+	lf_obj* arg = lf_take(ctx, 0);
+	lf_obj* src = lf_take(ctx, 0);
+	lf_obj* obj;
+	check_obj(ctx, src, LF_TSEQ);
+	obj = make_seq(ctx, kind);
+	seq(obj)->stg.src = make_ref(ctx, src);
+	seq(obj)->stg.src->next = NULL;
+	if (kind == SEQ_TAKE)
+	{
+		seq(obj)->stg.fn = NULL;
+		seq(obj)->stg.n = (lf_int)lf_to_num(ctx, arg);
+	}
+	else
+	{
+		seq(obj)->stg.fn = make_ref(ctx, arg);
+		seq(obj)->stg.fn->next = NULL;
+	}
+	push_obj(ctx, obj);
+}
+
+/* Check that 'src' is list or sequence */
+static void check_src(lf_ctx* ctx, lf_obj* src)
+{
+	if (src->type != LF_TLST)
+	{
+		check_obj(ctx, src, LF_TSEQ);
+	}
+}
+
+/* Push next element of list or sequence, 'it' is next element of list */
+static int pull_next(lf_ctx* ctx, lf_obj* src, lf_obj** it)
+{
+	if (src->type == LF_TSEQ)
+	{
+		return seq_next(ctx, src);
+	}
+	else if (*it != NULL)
+	{
+		push_obj(ctx, make_ref(ctx, *it));
+		*it = (*it)->next;
+		return 1;
+	}
+	return 0;
+}
+
+/* Take 'n' top elements of stack into list in order they were pushed */
+static lf_obj* take_list(lf_ctx* ctx, lf_int n)
+{
+	lf_obj* head = NULL;
+	while (n-- > 0)
+	{
+		lf_obj* obj = ctx->stck;
+		ctx->stck = obj->next;
+		obj->next = head;
+		head = obj;
+		--ctx->size;
+	}
+	return make_lst(ctx, head);
+}
+
+/* Map or, if 'filter' is set, filter list with quotation */
+static void map_list(lf_ctx* ctx, int filter)
+{
+	lf_obj* fn = keep(ctx, 0);
+	lf_obj* lst = keep(ctx, 0);
+	lf_obj* it;
+	lf_int base = ctx->size;
+	for (it = obj(lst); it != NULL; it = it->next)
+	{
+		push_obj(ctx, make_ref(ctx, it));
+		if (filter)
+		{
+			push_obj(ctx, make_ref(ctx, it));
+			apply(ctx, make_ref(ctx, fn));
+			if (!pop_cond(ctx))
+			{
+				lf_take(ctx, 0);
+			}
+		}
+		else
+		{
+			apply(ctx, make_ref(ctx, fn));
+		}
+		if (ctx->size < base)
+		{
+			lf_raise(ctx, LF_SUNDFLW, "stack underflow");
+		}
+	}
+	pop_frame(ctx);
+	pop_frame(ctx);
+	push_obj(ctx, take_list(ctx, ctx->size - base));
+}
+
+void lf_rng(lf_ctx* ctx)
+{
+	lf_num end = lf_to_num(ctx, lf_take(ctx, 0));
+	lf_num cur = lf_to_num(ctx, lf_take(ctx, 0));
+	lf_obj* obj = make_seq(ctx, SEQ_RANGE);
+	seq(obj)->rng.cur = cur;
+	seq(obj)->rng.end = end;
+	push_obj(ctx, obj);
+}
+
+void lf_smap(lf_ctx* ctx)
+{
+	if (lf_peek(ctx, 1)->type == LF_TLST)
+	{
+		map_list(ctx, 0);
+		return;
+	}
+	push_stage(ctx, SEQ_MAP);
+}
+
+void lf_sflt(lf_ctx* ctx)
+{
+	if (lf_peek(ctx, 1)->type == LF_TLST)
+	{
+		map_list(ctx, 1);
+		return;
+	}
+	push_stage(ctx, SEQ_FILTER);
+}
+
+void lf_stak(lf_ctx* ctx)
+{
+	push_stage(ctx, SEQ_TAKE);
+}
+
+void lf_each(lf_ctx* ctx)
+{
+	lf_obj* fn;
+	lf_obj* src;
+	lf_obj* it;
+	check_src(ctx, lf_peek(ctx, 1));
+	fn = keep(ctx, 0);
+	src = keep(ctx, 0);
+	it = obj(src);
+	while (pull_next(ctx, src, &it))
+	{
+		apply(ctx, make_ref(ctx, fn));
+	}
+	pop_frame(ctx);
+	pop_frame(ctx);
+}
+
+void lf_fold(lf_ctx* ctx)
+{
+	lf_obj* fn;
+	lf_obj* src;
+	lf_obj* it;
+	check_src(ctx, lf_peek(ctx, 2));
+	fn = keep(ctx, 0);
+	src = keep(ctx, 1);
+	it = obj(src);
+	while (pull_next(ctx, src, &it))
+	{
+		apply(ctx, make_ref(ctx, fn));
+	}
+	pop_frame(ctx);
+	pop_frame(ctx);
+}
+
+void lf_spul(lf_ctx* ctx)
+{
+	lf_int cnt = 0;
+	lf_obj* seq;
+	check_obj(ctx, lf_peek(ctx, 0), LF_TSEQ);
+	seq = keep(ctx, 0);
+	while (seq_next(ctx, seq))
+	{
+		++cnt;
+	}
+	pop_frame(ctx);
+	lf_push_num(ctx, cnt);
+}
+
+/******************************************************************************
+ * List operations
+ *****************************************************************************/
+
+/*
+ * List operations work on chain of elements directly. List that has several
+ * references is copied before modification, unique list is modified in place.
+ */
+
+static void own_list(lf_ctx* ctx, lf_obj* lst)
+{
+	if (lst->ref->cnt > 1)
+	{
+		lf_obj* head = NULL;
+		lf_obj** tail = &head;
+		lf_obj* it;
+		for (it = obj(lst); it != NULL; it = it->next)
+		{
+			*tail = make_ref(ctx, it);
+			tail = &(*tail)->next;
+		}
+		*tail = NULL;
+		unref(lst);
+		lst->ref = (lf_ref*)make_block(ctx);
+		lst->ref->cnt = 1;
+		++ctx->objs[LF_TLST];
+		obj(lst) = head;
+	}
+	hash(lst) = 0;
+}
+
+void lf_lrev(lf_ctx* ctx)
+{
+	lf_obj* lst = lf_peek(ctx, 0);
+	lf_obj* res = NULL;
+	lf_obj* it;
+	check_obj(ctx, lst, LF_TLST);
+	own_list(ctx, lst);
+	it = obj(lst);
+	while (it != NULL)
+	{
+		lf_obj* next = it->next;
+		it->next = res;
+		res = it;
+		it = next;
+	}
+	obj(lst) = res;
+}
+
+void lf_cat(lf_ctx* ctx)
+{
+	lf_obj* b = lf_take(ctx, 0);
+	lf_obj* a = lf_peek(ctx, 0);
+	lf_obj** tail;
+	lf_obj* it;
+	check_obj(ctx, a, LF_TLST);
+	check_obj(ctx, b, LF_TLST);
+	own_list(ctx, a);
+	tail = &obj(a);
+	while (*tail != NULL)
+	{
+		tail = &(*tail)->next;
+	}
+	if (b->ref->cnt == 1)
+	{
+		/* Move elements of unique list */
+		*tail = obj(b);
+		obj(b) = NULL;
+	}
+	else
+	{
+		for (it = obj(b); it != NULL; it = it->next)
+		{
+			*tail = make_ref(ctx, it);
+			tail = &(*tail)->next;
+		}
+		*tail = NULL;
+	}
+}
+
+static int less(const lf_obj* a, const lf_obj* b)
+{
+	return a->type == LF_TNUM ? num(a) < num(b) : strord(str(a), str(b)) < 0;
+}
+
+/* Stable merge sort of chain of 'n' elements */
+static lf_obj* merge_sort(lf_obj* head, lf_int n)
+{
+	lf_obj* a;
+	lf_obj* b;
+	lf_obj** tail;
+	lf_int i;
+	if (n < 2)
+	{
+		return head;
+	}
+	for (i = 1, b = head; i < n / 2; ++i)
+	{
+		b = b->next;
+	}
+	a = b;
+	b = b->next;
+	a->next = NULL;
+	a = merge_sort(head, n / 2);
+	b = merge_sort(b, n - n / 2);
+	tail = &head;
+	while (a != NULL && b != NULL)
+	{
+		if (less(b, a))
+		{
+			*tail = b;
+			b = b->next;
+		}
+		else
+		{
+			*tail = a;
+			a = a->next;
+		}
+		tail = &(*tail)->next;
+	}
+	*tail = a != NULL ? a : b;
+	return head;
+}
+
+void lf_sort(lf_ctx* ctx)
+{
+	lf_obj* lst = lf_peek(ctx, 0);
+	lf_obj* it;
+	lf_int n = 0;
+	check_obj(ctx, lst, LF_TLST);
+	/* Check elements before sort, so error not breaks list */
+	for (it = obj(lst); it != NULL; it = it->next, ++n)
+	{
+		if (it->type != LF_TNUM && it->type != LF_TSTR && it->type != LF_TSYM)
+		{
+			check_obj(ctx, it, LF_TNUM);
+		}
+		else if ((it->type == LF_TNUM) != (obj(lst)->type == LF_TNUM))
+		{
+			lf_raise(ctx, LF_SRUNERR, "can't compare num and str");
+		}
+	}
+	own_list(ctx, lst);
+	obj(lst) = merge_sort(obj(lst), n);
+}
+
+/******************************************************************************
+ * String operations
+ *****************************************************************************/
+
+/*
+ * Strings are built by appending characters to last chunk, so new fragments
+ * are added without copying of previous ones. String builder keeps its last
+ * chunk, so append to builder don't walk string.
+ */
+
+static void sbld_open(lf_sbld* b, lf_str* str)
+{
+	b->head = str;
+	b->tail = str;
+	b->fill = LF_STRBUF_SIZE - 1;
+	if (str != NULL)
+	{
+		while (b->tail->next != NULL)
+		{
+			b->tail = b->tail->next;
+		}
+		b->fill = strlen(b->tail->buf);
+	}
+}
+
+static void sbld_putc(lf_ctx* ctx, lf_sbld* b, char c)
+{
+	if (b->fill == LF_STRBUF_SIZE - 1)
+	{
+		lf_str* str = (lf_str*)make_block(ctx);
+		++ctx->strs;
+		str->next = NULL;
+		if (b->tail != NULL)
+		{
+			b->tail->next = str;
+		}
+		else
+		{
+			b->head = str;
+		}
+		b->tail = str;
+		b->fill = 0;
+	}
+	b->tail->buf[b->fill++] = c;
+	b->tail->buf[b->fill] = '\0';
+}
+
+/* Append at most 'n' characters of 'str' starting from 'i' of first chunk */
+static unsigned sbld_puts(lf_ctx* ctx, lf_sbld* b, const lf_str* str,
+	unsigned i, unsigned n)
+{
+	unsigned cnt = 0;
+	char c;
+	while (cnt < n && (c = str_getc(&str, &i)) != '\0')
+	{
+		sbld_putc(ctx, b, c);
+		++cnt;
+	}
+	return cnt;
+}
+
+static unsigned str_len(const lf_str* str)
+{
+	unsigned len = 0;
+	for (; str != NULL; str = str->next)
+	{
+		len += strlen(str->buf);
+	}
+	return len;
+}
+
+/* Check that string is unique before modification */
+static void own_str(lf_ctx* ctx, lf_obj* obj)
+{
+	if (obj->ref->cnt > 1)
+	{
+		lf_sbld b;
+		sbld_open(&b, NULL);
+		sbld_puts(ctx, &b, str(obj), 0, (unsigned)-1);
+		unref(obj);
+		obj->ref = (lf_ref*)make_block(ctx);
+		obj->ref->cnt = 1;
+		++ctx->objs[obj->type];
+		str(obj) = b.head;
+	}
+	hash(obj) = 0;
+}
+
+/* Check that builder is unique before modification */
+static void own_bld(lf_ctx* ctx, lf_obj* obj)
+{
+	if (obj->ref->cnt > 1)
+	{
+		lf_sbld* b = (lf_sbld*)make_block(ctx);
+		sbld_open(b, NULL);
+		sbld_puts(ctx, b, bld(obj)->head, 0, (unsigned)-1);
+		unref(obj);
+		obj->ref = (lf_ref*)make_block(ctx);
+		obj->ref->cnt = 1;
+		++ctx->objs[LF_TBLD];
+		obj->ref->bld.len = str_len(b->head);
+		bld(obj) = b;
+	}
+}
+
+void lf_scat(lf_ctx* ctx)
+{
+	lf_obj* b = lf_take(ctx, 0);
+	lf_obj* a = lf_peek(ctx, 0);
+	lf_sbld w;
+	check_obj(ctx, a, LF_TSTR);
+	check_obj(ctx, b, LF_TSTR);
+	own_str(ctx, a);
+	sbld_open(&w, str(a));
+	sbld_puts(ctx, &w, str(b), 0, (unsigned)-1);
+	str(a) = w.head;
+}
+
+void lf_slen(lf_ctx* ctx)
+{
+	lf_push_num(ctx, str_len(lf_to_str(ctx, lf_take(ctx, 0))));
+}
+
+void lf_ssub(lf_ctx* ctx)
+{
+	lf_obj* to = lf_take(ctx, 0);
+	lf_obj* from = lf_take(ctx, 0);
+	const lf_str* str = lf_to_str(ctx, lf_take(ctx, 0));
+	lf_obj* res;
+	lf_sbld w;
+	unsigned i, j, k = 0;
+	j = to_index(ctx, to, str_len(str) + 1);
+	for (i = to_index(ctx, from, j + 1); i > 0; --i, --j)
+	{
+		str_getc(&str, &k);
+	}
+	sbld_open(&w, NULL);
+	sbld_puts(ctx, &w, str, k, j);
+	res = make_obj(ctx, LF_TSTR);
+	str(res) = w.head;
+	push_obj(ctx, res);
+}
+
+void lf_sfnd(lf_ctx* ctx)
+{
+	const lf_str* pat = lf_to_str(ctx, lf_take(ctx, 0));
+	const lf_str* str = lf_to_str(ctx, lf_take(ctx, 0));
+	unsigned i = 0;
+	lf_int idx = 0;
+	for (;;)
+	{
+		/* Compare pattern with string from current position */
+		const lf_str* a = str;
+		const lf_str* b = pat;
+		unsigned ia = i, ib = 0;
+		char ca, cb;
+		do
+		{
+			cb = str_getc(&b, &ib);
+			ca = cb != '\0' ? str_getc(&a, &ia) : '\0';
+		}
+		while (cb != '\0' && ca == cb);
+		if (cb == '\0')
+		{
+			break;
+		}
+		else if (ca == '\0')
+		{
+			idx = -1;
+			break;
+		}
+		str_getc(&str, &i);
+		++idx;
+	}
+	lf_push_num(ctx, idx);
+}
+
+void lf_ntos(lf_ctx* ctx)
+{
+	char buf[32];
+	format_num(buf, lf_to_num(ctx, lf_take(ctx, 0)));
+	lf_push_str(ctx, buf, 0);
+}
+
+void lf_badd(lf_ctx* ctx)
+{
+	lf_obj* obj = lf_take(ctx, 0);
+	lf_obj* b = lf_peek(ctx, 0);
+	char buf[32];
+	check_obj(ctx, b, LF_TBLD);
+	own_bld(ctx, b);
+	if (obj->type == LF_TNUM)
+	{
+		unsigned i;
+		format_num(buf, num(obj));
+		for (i = 0; buf[i] != '\0'; ++i)
+		{
+			sbld_putc(ctx, bld(b), buf[i]);
+		}
+		b->ref->bld.len += i;
+	}
+	else
+	{
+		if (obj->type != LF_TSYM)
+		{
+			check_obj(ctx, obj, LF_TSTR);
+		}
+		b->ref->bld.len += sbld_puts(ctx, bld(b), str(obj), 0, (unsigned)-1);
+	}
+}
+
+void lf_bstr(lf_ctx* ctx)
+{
+	lf_obj* b = lf_take(ctx, 0);
+	lf_obj* res;
+	check_obj(ctx, b, LF_TBLD);
+	res = make_obj(ctx, LF_TSTR);
+	if (b->ref->cnt == 1)
+	{
+		/* Move characters of unique builder */
+		str(res) = bld(b)->head;
+		bld(b)->head = NULL;
+	}
+	else
+	{
+		lf_sbld w;
+		sbld_open(&w, NULL);
+		sbld_puts(ctx, &w, bld(b)->head, 0, (unsigned)-1);
+		str(res) = w.head;
+	}
+	push_obj(ctx, res);
+}
+
+/******************************************************************************
+ * Coroutine operations
+ *****************************************************************************/
+
+/*
+ * Coroutine has own stack and frames, it shares dictionary and memory with
+ * context. Resume and yield swap state of context with state saved by
+ * coroutine, so coroutine is evaluated by the same loop as its caller. Bottom
+ * frame of coroutine has no code and list, it returns from coroutine.
+ */
+
+void lf_spwn(lf_ctx* ctx)
+{
+	lf_obj* quot;
+	lf_obj* obj;
+	lf_frm* frm;
+	check_obj(ctx, lf_peek(ctx, 0), LF_TLST);
+	obj = make_obj(ctx, LF_TCOR);
+	obj->ref->cor.nest = COR_IDLE;
+	cor(obj) = (lf_cor*)make_block(ctx);
+	cor(obj)->stck = NULL;
+	cor(obj)->frms = NULL;
+	cor(obj)->size = 0;
+	push_obj(ctx, obj);
+	/*
+	 * Frames are made while coroutine is on stack and frames of context aren't
+	 * touched, so error leaves both consistent. Empty frame ends coroutine,
+	 * frame above it evaluates quotation like call does.
+	 */
+	frm = (lf_frm*)make_block(ctx);
+	frm->code = NULL;
+	frm->list = NULL;
+	frm->next = NULL;
+	cor(obj)->frms = frm;
+	frm = (lf_frm*)make_block(ctx);
+	quot = ctx->stck->next;
+	ctx->stck->next = quot->next;
+	--ctx->size;
+	quot->next = NULL;
+	if (obj(quot) == NULL)
+	{
+		free_block(ctx, frm);
+		free_obj(ctx, quot);
+		profile(ctx, prof_enter(ctx, NULL));
+		return;
+	}
+	frm->code = quot->ref->cnt == 1 ? NULL : obj(quot);
+	frm->list = quot;
+	frm->next = cor(obj)->frms;
+	cor(obj)->frms = frm;
+	profile(ctx, prof_enter(ctx, frm));
+}
+
+void lf_cres(lf_ctx* ctx)
+{
+	lf_obj* cor = lf_peek(ctx, 0);
+	check_obj(ctx, cor, LF_TCOR);
+	if (cor->ref->cor.nest != COR_IDLE)
+	{
+		lf_raise(ctx, LF_SRUNERR, "coroutine is running");
+	}
+	else if (cor->ref->cnt == FROZEN)
+	{
+		lf_raise(ctx, LF_SRUNERR, "coroutine is frozen");
+	}
+	cor = detach(ctx);
+	if (cor(cor)->frms == NULL)
+	{
+		/* Coroutine is finished */
+		push_obj(ctx, cor);
+		push_cond(ctx, 0);
+		return;
+	}
+	cor->ref->cor.nest = ctx->nest;
+	cor->next = ctx->cors;
+	ctx->cors = cor;
+	switch_cor(ctx, cor);
+}
+
+void lf_yld(lf_ctx* ctx)
+{
+	lf_obj* cor = ctx->cors;
+	lf_obj* val;
+	if (cor == NULL)
+	{
+		lf_raise(ctx, LF_SRUNERR, "yield outside of coroutine");
+	}
+	else if (cor->ref->cor.nest != ctx->nest)
+	{
+		lf_raise(ctx, LF_SRUNERR, "yield from nested evaluation");
+	}
+	val = detach(ctx);
+	switch_cor(ctx, cor);
+	ctx->cors = cor->next;
+	cor->ref->cor.nest = COR_IDLE;
+	push_obj(ctx, cor);
+	push_obj(ctx, val);
+	push_cond(ctx, 1);
+}
+
+/******************************************************************************
+ * Serialization
+ *****************************************************************************/
+
+/*
+ * Object is encoded as tag followed by its data, tag is type of object or one
+ * of TAG_*. Lengths and whole numbers are written by 7 bits per byte. Object
+ * with several references gets next slot (tag has TAG_NEW flag), next
+ * occurrences of it are written as references to slot, so shared objects are
+ * shared after decoding too. Local encoding is used to pass objects within
+ * process: natives, channels and frozen objects are written as addresses.
+ * Otherwise natives are written as name of builtin, which doesn't depend on
+ * the build, and frozen objects are copied.
+ */
+
+#define TAG_NEW 0x80 /* flag of object that gets next slot */
+#define TAG_INT 0x7B /* whole number */
+#define TAG_REF 0x7C /* reference to slot */
+#define TAG_END 0x7D /* end of list */
+#define TAG_FRZ 0x7E /* frozen object, passed by address */
+
+#define SLOTS_MAX  256 /* max count of shared objects */
+#define DEPTH_MAX  256 /* max nesting of objects */
+#define SLOTS_HASH 512 /* size of hash table of shared objects */
+
+typedef struct lf_enc lf_enc;
+
+struct lf_enc
+{
+	unsigned char* dst;            /* output, NULL if only size is counted */
+	unsigned cap;                  /* size of output */
+	unsigned pos;                  /* size of data, may exceed 'cap' */
+	int local;                     /* encoding within process */
+	unsigned cnt;                  /* count of slots, -1 if table is empty */
+	const lf_ref* ref[SLOTS_HASH]; /* shared objects */
+	unsigned slot[SLOTS_HASH];     /* their slots */
+};
+
+typedef struct lf_dec lf_dec;
+
+struct lf_dec
+{
+	const unsigned char* src; /* next byte */
+	const unsigned char* end; /* end of input */
+	int local;                /* encoding within process */
+	unsigned cnt;             /* count of slots */
+	lf_obj* slot[SLOTS_MAX];  /* references to shared objects, NULL if unfinished */
+};
+
+static void put_bytes(lf_enc* enc, const void* src, unsigned n)
+{
+	if (enc->dst != NULL && enc->pos + n <= enc->cap)
+	{
+		memcpy(enc->dst + enc->pos, src, n);
+	}
+	enc->pos += n;
+}
+
+static void put_byte(lf_enc* enc, unsigned c)
+{
+	unsigned char b = (unsigned char)c;
+	put_bytes(enc, &b, 1);
+}
+
+static void put_uint(lf_enc* enc, unsigned long v)
+{
+	while (v >= 0x80)
+	{
+		put_byte(enc, (v & 0x7F) | 0x80);
+		v >>= 7;
+	}
+	put_byte(enc, v);
+}
+
+/* Signed integers are zigzag encoded: 0, -1, 1, -2, ... */
+static void put_int(lf_enc* enc, long v)
+{
+	put_uint(enc, v < 0 ? ((unsigned long)-(v + 1) << 1) | 1 :
+		(unsigned long)v << 1);
+}
+
+/* Find object in hash table or empty place for it */
+static unsigned find_slot(lf_enc* enc, const lf_ref* ref)
+{
+	unsigned i = (unsigned)(((unsigned long)ref / LF_BLOCK_SIZE) % SLOTS_HASH);
+	if (enc->cnt == (unsigned)-1)
+	{
+		memset(enc->ref, 0, sizeof(enc->ref));
+		enc->cnt = 0;
+	}
+	while (enc->ref[i] != NULL && enc->ref[i] != ref)
+	{
+		i = (i + 1) % SLOTS_HASH;
+	}
+	return i;
+}
+
+static int whole(lf_num num)
+{
+	static const lf_num zero = 0;
+	return num > -2147483647.0 && num < 2147483647.0
+		&& (lf_num)(long)num == num
+		&& (num != 0 || memcmp(&num, &zero, sizeof(num)) == 0); /* not -0 */
+}
+
+static void encode(lf_ctx* ctx, lf_enc* enc, const lf_obj* obj,
+	unsigned depth);
+
+static void encode_node(lf_ctx* ctx, lf_enc* enc, const lf_node* node,
+	unsigned depth)
+{
+	for (; node != NULL; node = node->ge)
+	{
+		encode_node(ctx, enc, node->lt, depth);
+		encode(ctx, enc, node->key, depth);
+		encode(ctx, enc, node->key->next, depth);
+	}
+}
+
+/* Write object nested at 'depth', data deeper than DEPTH_MAX isn't written */
+static void encode(lf_ctx* ctx, lf_enc* enc, const lf_obj* obj,
+	unsigned depth)
+{
+	const lf_obj* it;
+	const lf_str* str;
+	unsigned i, n, flag = 0;
+	if (depth == DEPTH_MAX)
+	{
+		lf_raise(ctx, LF_SRUNERR, "too deep to serialize");
+		return;
+	}
+	if (enc->local && obj->ref->cnt == FROZEN)
+	{
+		put_byte(enc, TAG_FRZ);
+		put_byte(enc, obj->type);
+		put_bytes(enc, &obj->ref, sizeof(obj->ref));
+		return;
+	}
+	if (obj->ref->cnt > 1)
+	{
+		i = find_slot(enc, obj->ref);
+		if (enc->ref[i] != NULL)
+		{
+			put_byte(enc, TAG_REF);
+			put_uint(enc, enc->slot[i]);
+			return;
+		}
+		else if (enc->cnt < SLOTS_MAX)
+		{
+			enc->ref[i] = obj->ref;
+			enc->slot[i] = enc->cnt++;
+			flag = TAG_NEW;
+		}
+	}
+	if (obj->type == LF_TNUM && whole(num(obj)))
+	{
+		put_byte(enc, TAG_INT | flag);
+		put_int(enc, (long)num(obj));
+		return;
+	}
+	put_byte(enc, obj->type | flag);
+	switch (obj->type)
+	{
+		case LF_TLST:
+			for (it = obj(obj); it != NULL; it = it->next)
+			{
+				encode(ctx, enc, it, depth + 1);
+			}
+			put_byte(enc, TAG_END);
+			return;
+		case LF_TSYM:
+		case LF_TSTR:
+		case LF_TBLD:
+			str = obj->type == LF_TBLD ? bld(obj)->head : str(obj);
+			put_uint(enc, str_len(str));
+			for (; str != NULL; str = str->next)
+			{
+				put_bytes(enc, str->buf, strlen(str->buf));
+			}
+			return;
+		case LF_TNUM:
+			put_bytes(enc, &num(obj), sizeof(lf_num));
+			return;
+		case LF_TNTV:
+			if (enc->local)
+			{
+				put_bytes(enc, &ntv(obj), sizeof(lf_ntv));
+				return;
+			}
+			for (i = 0; i < sizeof(builtin_val) / sizeof(builtin_val[0]); ++i)
+			{
+				if (builtin_val[i] == ntv(obj))
+				{
+					n = (unsigned)strlen(builtin_key[i]);
+					put_uint(enc, n);
+					put_bytes(enc, builtin_key[i], n);
+					return;
+				}
+			}
+			break;
+		case LF_TMAP:
+			put_uint(enc, obj->ref->map.len);
+			encode_node(ctx, enc, map(obj), depth + 1);
+			return;
+		case LF_TARR:
+			put_uint(enc, obj->ref->arr.len);
+			for (i = 0; i < obj->ref->arr.len; ++i)
+			{
+				encode(ctx, enc,
+					(lf_obj*)arr_leaf(obj, i / TREE_SPAN)[i % TREE_SPAN], depth + 1);
+			}
+			return;
+		case LF_TVEC:
+			put_uint(enc, obj->ref->arr.len);
+			for (i = 0; i < obj->ref->arr.len; i += n)
+			{
+				n = obj->ref->arr.len - i;
+				n = n < VEC_SPAN ? n : VEC_SPAN;
+				put_bytes(enc, vec_leaf(obj, i / VEC_SPAN), n * sizeof(lf_num));
+			}
+			return;
+		case LF_TSEQ:
+			put_byte(enc, obj->ref->seq.kind);
+			if (obj->ref->seq.kind == SEQ_RANGE)
+			{
+				put_bytes(enc, &seq(obj)->rng, sizeof(seq(obj)->rng));
+				return;
+			}
+			encode(ctx, enc, seq(obj)->stg.src, depth + 1);
+			if (obj->ref->seq.kind == SEQ_TAKE)
+			{
+				put_int(enc, seq(obj)->stg.n);
+			}
+			else
+			{
+				encode(ctx, enc, seq(obj)->stg.fn, depth + 1);
+			}
+			return;
+#ifdef LF_THREADS
+		case LF_TCHN:
+			if (enc->local)
+			{
+				put_bytes(enc, &chn(obj), sizeof(chn(obj)));
+				return;
+			}
+			break;
+#endif
+		default:
+			break;
+	}
+	{
+		char buf[32];
+		sprintf(buf, "can't serialize %s", lf_typenames[obj->type]);
+		lf_raise(ctx, LF_SRUNERR, buf);
+	}
+}
+
+/* Serialize object to 'buf', returns size of data (data fits if <= 'cap') */
+static unsigned dump(lf_ctx* ctx, const lf_obj* obj, void* buf, unsigned cap,
+	int local)
+{
+	lf_enc enc;
+	enc.dst = (unsigned char*)buf;
+	enc.cap = cap;
+	enc.pos = 0;
+	enc.local = local;
+	enc.cnt = (unsigned)-1;
+	encode(ctx, &enc, obj, 0);
+	return enc.pos;
+}
+
+/* Decoding can't continue even if handler ignores error */
+static void malformed(lf_ctx* ctx)
+{
+	lf_raise(ctx, LF_SRUNERR, "malformed data");
+	longjmp(ctx->sbuf, LF_SRUNERR);
+}
+
+static const unsigned char* get_bytes(lf_ctx* ctx, lf_dec* dec,
+	unsigned long n)
+{
+	const unsigned char* src = dec->src;
+	if ((unsigned long)(dec->end - src) < n)
+	{
+		malformed(ctx);
+	}
+	dec->src += n;
+	return src;
+}
+
+#define get_byte(ctx, dec) (*get_bytes(ctx, dec, 1))
+
+static unsigned long get_uint(lf_ctx* ctx, lf_dec* dec)
+{
+	unsigned long v = 0;
+	unsigned shift = 0;
+	unsigned c;
+	do
+	{
+		c = get_byte(ctx, dec);
+		if (shift >= sizeof(v) * 8)
+		{
+			malformed(ctx);
+		}
+		v |= (unsigned long)(c & 0x7F) << shift;
+		shift += 7;
+	}
+	while (c & 0x80);
+	return v;
+}
+
+static long get_int(lf_ctx* ctx, lf_dec* dec)
+{
+	unsigned long v = get_uint(ctx, dec);
+	return v & 1 ? -(long)(v >> 1) - 1 : (long)(v >> 1);
+}
+
+/* Push decoded object nested at 'depth' */
+static void decode(lf_ctx* ctx, lf_dec* dec, unsigned depth)
+{
+	unsigned tag = get_byte(ctx, dec);
+	unsigned long i, n, slot = SLOTS_MAX;
+	lf_obj* obj;
+	if (depth == DEPTH_MAX)
+	{
+		malformed(ctx);
+	}
+	if (tag & TAG_NEW)
+	{
+		if (dec->cnt == SLOTS_MAX)
+		{
+			malformed(ctx);
+		}
+		slot = dec->cnt++;
+		dec->slot[slot] = NULL;
+		tag &= ~TAG_NEW;
+	}
+	switch (tag)
+	{
+		case LF_TLST:
+			for (n = 0; dec->src < dec->end && *dec->src != TAG_END; ++n)
+			{
+				decode(ctx, dec, depth + 1);
+			}
+			get_bytes(ctx, dec, 1); /* TAG_END */
+			push_obj(ctx, take_list(ctx, n));
+			break;
+		case LF_TSYM:
+		case LF_TSTR:
+		case LF_TBLD:
+		{
+			const char* txt;
+			n = get_uint(ctx, dec);
+			txt = (const char*)get_bytes(ctx, dec, n);
+			if (memchr(txt, '\0', n) != NULL)
+			{
+				malformed(ctx);
+			}
+			if (tag == LF_TBLD)
+			{
+				lf_push_bld(ctx);
+				obj = ctx->stck;
+				for (i = 0; i < n; ++i)
+				{
+					sbld_putc(ctx, bld(obj), txt[i]);
+					++obj->ref->bld.len;
+				}
+			}
+			else
+			{
+				(tag == LF_TSYM ? lf_push_sym : lf_push_str)(ctx,
+					n > 0 ? txt : "", n);
+			}
+			break;
+		}
+		case TAG_INT:
+			lf_push_num(ctx, (lf_num)get_int(ctx, dec));
+			break;
+		case LF_TNUM:
+		{
+			lf_num num;
+			memcpy(&num, get_bytes(ctx, dec, sizeof(num)), sizeof(num));
+			lf_push_num(ctx, num);
+			break;
+		}
+		case LF_TNTV:
+		{
+			lf_ntv fn = NULL;
+			char name[16];
+			if (dec->local)
+			{
+				memcpy(&fn, get_bytes(ctx, dec, sizeof(fn)), sizeof(fn));
+			}
+			else if ((n = get_uint(ctx, dec)) < sizeof(name))
+			{
+				memcpy(name, get_bytes(ctx, dec, n), n);
+				name[n] = '\0';
+				fn = find_builtin(name);
+			}
+			if (fn == NULL)
+			{
+				malformed(ctx);
+			}
+			lf_push_ntv(ctx, fn);
+			break;
+		}
+		case LF_TMAP:
+			n = get_uint(ctx, dec);
+			lf_push_map(ctx);
+			for (i = 0; i < n; ++i)
+			{
+				decode(ctx, dec, depth + 1);
+				decode(ctx, dec, depth + 1);
+				lf_put(ctx);
+			}
+			break;
+		case LF_TARR:
+			n = get_uint(ctx, dec);
+			if (n > (unsigned long)(dec->end - dec->src))
+			{
+				malformed(ctx);
+			}
+			for (i = 0; i < n; ++i)
+			{
+				decode(ctx, dec, depth + 1);
+			}
+			if (n > 0)
+			{
+				lf_push_num(ctx, (lf_num)(n - 1));
+				lf_awrp(ctx);
+			}
+			else
+			{
+				lf_push_arr(ctx);
+			}
+			break;
+		case LF_TVEC:
+		{
+			unsigned depth;
+			n = get_uint(ctx, dec);
+			if (n > (unsigned long)(dec->end - dec->src) / sizeof(lf_num))
+			{
+				malformed(ctx);
+			}
+			obj = make_arr(ctx, LF_TVEC, (unsigned)n);
+			push_obj(ctx, obj);
+			depth = obj->ref->arr.depth;
+			for (i = 0; i < n; i += VEC_SPAN)
+			{
+				unsigned long k = n - i < VEC_SPAN ? n - i : VEC_SPAN;
+				void* leaf = make_leaf(ctx, &arr(obj), depth,
+					(unsigned)(i / VEC_SPAN));
+				memcpy(leaf, get_bytes(ctx, dec, k * sizeof(lf_num)),
+					k * sizeof(lf_num));
+			}
+			break;
+		}
+		case LF_TSEQ:
+			n = get_byte(ctx, dec);
+			if (n == SEQ_RANGE)
+			{
+				obj = make_seq(ctx, SEQ_RANGE);
+				push_obj(ctx, obj);
+				memcpy(&seq(obj)->rng, get_bytes(ctx, dec, sizeof(seq(obj)->rng)),
+					sizeof(seq(obj)->rng));
+				break;
+			}
+			else if (n > SEQ_TAKE)
+			{
+				malformed(ctx);
+			}
+			decode(ctx, dec, depth + 1);
+			if (n == SEQ_TAKE)
+			{
+				lf_push_num(ctx, (lf_num)get_int(ctx, dec));
+			}
+			else
+			{
+				decode(ctx, dec, depth + 1);
+			}
+			push_stage(ctx, (unsigned)n);
+			break;
+#ifdef LF_THREADS
+		case LF_TCHN:
+		{
+			lf_chan* chn;
+			if (!dec->local)
+			{
+				malformed(ctx);
+			}
+			memcpy(&chn, get_bytes(ctx, dec, sizeof(chn)), sizeof(chn));
+			lf_push_chn(ctx, chn);
+			break;
+		}
+#endif
+		case TAG_FRZ:
+			if (!dec->local || slot != SLOTS_MAX)
+			{
+				malformed(ctx);
+			}
+			obj = (lf_obj*)make_block(ctx);
+			obj->type = (lf_type)get_byte(ctx, dec);
+			memcpy(&obj->ref, get_bytes(ctx, dec, sizeof(obj->ref)),
+				sizeof(obj->ref));
+			push_obj(ctx, obj);
+			break;
+		case TAG_REF:
+			i = get_uint(ctx, dec);
+			if (slot != SLOTS_MAX || i >= dec->cnt || dec->slot[i] == NULL)
+			{
+				malformed(ctx);
+			}
+			push_obj(ctx, make_ref(ctx, dec->slot[i]));
+			break;
+		default:
+			malformed(ctx);
+	}
+	if (slot != SLOTS_MAX)
+	{
+		/* Slot holds reference, object may be replaced in map later */
+		dec->slot[slot] = make_ref(ctx, ctx->stck);
+	}
+}
+
+/* Push object decoded from 'len' bytes, on error stack is restored */
+/*
+ * Decode whole data. Decoder is changed after 'setjmp' and read after signal,
+ * so it's owned by caller, which doesn't call 'setjmp'.
+ */
+static lf_sig decode_all(lf_ctx* ctx, lf_dec* dec)
+{
+	jmp_buf sbuf;
+	lf_int size = ctx->size;
+	lf_sig sig;
+	memcpy(sbuf, ctx->sbuf, sizeof(jmp_buf));
+	sig = (lf_sig)setjmp(ctx->sbuf);
+	if (sig == LF_SOK)
+	{
+		decode(ctx, dec, 0);
+		if (dec->src != dec->end)
+		{
+			malformed(ctx);
+		}
+	}
+	else
+	{
+		while (ctx->size > size)
+		{
+			ctx->stck = free_obj(ctx, ctx->stck);
+			--ctx->size;
+		}
+	}
+	memcpy(ctx->sbuf, sbuf, sizeof(jmp_buf));
+	return sig;
+}
+
+static lf_sig load(lf_ctx* ctx, const void* buf, unsigned len, int local)
+{
+	lf_dec dec;
+	lf_sig sig;
+	unsigned i;
+	dec.cnt = 0;
+	dec.src = (const unsigned char*)buf;
+	dec.end = dec.src + len;
+	dec.local = local;
+	sig = decode_all(ctx, &dec);
+	for (i = 0; i < dec.cnt; ++i)
+	{
+		if (dec.slot[i] != NULL)
+		{
+			free_obj(ctx, dec.slot[i]);
+		}
+	}
+	return sig;
+}
+
+unsigned lf_dump(lf_ctx* ctx, lf_int idx, void* buf, unsigned size)
+{
+	jmp_buf sbuf;
+	unsigned len = 0;
+	memcpy(sbuf, ctx->sbuf, sizeof(jmp_buf));
+	if (setjmp(ctx->sbuf) == LF_SOK)
+	{
+		len = dump(ctx, lf_peek(ctx, idx), buf, size, 0);
+	}
+	memcpy(ctx->sbuf, sbuf, sizeof(jmp_buf));
+	return len;
+}
+
+lf_sig lf_load(lf_ctx* ctx, const void* buf, unsigned len)
+{
+	return load(ctx, buf, len, 0);
+}
+
+/******************************************************************************
+ * Parallel operations
+ *****************************************************************************/
+
+#ifdef LF_THREADS
+
+/*
+ * Objects are transferred between contexts by deep copy, so contexts never
+ * change reference counts of each other. Frozen objects are shared, because
+ * their counts are never changed. Userdata, buffers and coroutines can't be
+ * transferred.
+ */
+
+static int portable(const lf_obj* obj);
+
+static int portable_tree(void* node, unsigned depth)
+{
+	unsigned i;
+	if (node != NULL)
+	{
+		for (i = 0; i < TREE_SPAN; ++i)
+		{
+			if (depth > 0 ? !portable_tree(((void**)node)[i], depth - 1) :
+				((lf_obj**)node)[i] != NULL && !portable(((lf_obj**)node)[i]))
+			{
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+static int portable_node(const lf_node* node)
+{
+	for (; node != NULL; node = node->ge)
+	{
+		if (!portable_node(node->lt) || !portable(node->key) ||
+			!portable(node->key->next))
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int portable(const lf_obj* obj)
+{
+	const lf_obj* it;
+	if (obj->ref->cnt == FROZEN)
+	{
+		return 1;
+	}
+	switch (obj->type)
+	{
+		case LF_TLST:
+			for (it = obj(obj); it != NULL; it = it->next)
+			{
+				if (!portable(it))
+				{
+					return 0;
+				}
+			}
+			return 1;
+		case LF_TUSR:
+		case LF_TBUF:
+		case LF_TCOR:
+			return 0;
+		case LF_TMAP:
+			return portable_node(map(obj));
+		case LF_TARR:
+			return portable_tree(arr(obj), obj->ref->arr.depth);
+		case LF_TSEQ:
+			return obj->ref->seq.kind == SEQ_RANGE || (portable(seq(obj)->stg.src)
+				&& (seq(obj)->stg.fn == NULL || portable(seq(obj)->stg.fn)));
+		default:
+			return 1;
+	}
+}
+
+static lf_obj* transfer(lf_ctx* ctx, const lf_obj* obj);
+
+static void* transfer_tree(lf_ctx* ctx, void* node, unsigned depth, int objs)
+{
+	void** cpy = NULL;
+	unsigned i;
+	if (node != NULL)
+	{
+		cpy = (void**)make_block(ctx);
+		memcpy(cpy, node, LF_BLOCK_SIZE);
+		if (depth > 0 || objs)
+		{
+			for (i = 0; i < TREE_SPAN; ++i)
+			{
+				if (depth > 0)
+				{
+					cpy[i] = transfer_tree(ctx, cpy[i], depth - 1, objs);
+				}
+				else if (cpy[i] != NULL)
+				{
+					cpy[i] = transfer(ctx, (lf_obj*)cpy[i]);
+				}
+			}
+		}
+	}
+	return cpy;
+}
+
+static lf_node* transfer_node(lf_ctx* ctx, const lf_node* node)
+{
+	lf_node* cpy = NULL;
+	if (node != NULL)
+	{
+		cpy = (lf_node*)make_block(ctx);
+		cpy->key = transfer(ctx, node->key);
+		cpy->key->next = transfer(ctx, node->key->next);
+		cpy->lt = transfer_node(ctx, node->lt);
+		cpy->ge = transfer_node(ctx, node->ge);
+	}
+	return cpy;
+}
+
+/* Copy portable object from other context */
+static lf_obj* transfer(lf_ctx* ctx, const lf_obj* obj)
+{
+	lf_obj* cpy;
+	lf_obj** tail;
+	const lf_obj* it;
+	lf_sbld b;
+	if (obj->ref->cnt == FROZEN)
+	{
+		cpy = make_ref(ctx, obj);
+		cpy->next = NULL;
+		return cpy;
+	}
+	cpy = make_obj(ctx, obj->type);
+	cpy->next = NULL;
+	switch (obj->type)
+	{
+		case LF_TLST:
+			obj(cpy) = NULL;
+			tail = &obj(cpy);
+			for (it = obj(obj); it != NULL; it = it->next)
+			{
+				*tail = transfer(ctx, it);
+				tail = &(*tail)->next;
+			}
+			break;
+		case LF_TSYM:
+		case LF_TSTR:
+			sbld_open(&b, NULL);
+			sbld_puts(ctx, &b, str(obj), 0, (unsigned)-1);
+			str(cpy) = b.head;
+			hash(cpy) = hash(obj);
+			break;
+		case LF_TMAP:
+			cpy->ref->map.len = obj->ref->map.len;
+			map(cpy) = transfer_node(ctx, map(obj));
+			break;
+		case LF_TARR:
+		case LF_TVEC:
+			cpy->ref->arr.len = obj->ref->arr.len;
+			cpy->ref->arr.depth = obj->ref->arr.depth;
+			arr(cpy) = transfer_tree(ctx, arr(obj), obj->ref->arr.depth,
+				obj->type == LF_TARR);
+			break;
+		case LF_TSEQ:
+			cpy->ref->seq.kind = obj->ref->seq.kind;
+			seq(cpy) = (lf_seq*)make_block(ctx);
+			*seq(cpy) = *seq(obj);
+			if (obj->ref->seq.kind != SEQ_RANGE)
+			{
+				seq(cpy)->stg.src = transfer(ctx, seq(obj)->stg.src);
+				if (seq(obj)->stg.fn != NULL)
+				{
+					seq(cpy)->stg.fn = transfer(ctx, seq(obj)->stg.fn);
+				}
+			}
+			break;
+		case LF_TBLD:
+			cpy->ref->bld.len = obj->ref->bld.len;
+			bld(cpy) = (lf_sbld*)make_block(ctx);
+			sbld_open(bld(cpy), NULL);
+			sbld_puts(ctx, bld(cpy), bld(obj)->head, 0, (unsigned)-1);
+			break;
+		default:
+			*cpy->ref = *obj->ref;
+			cpy->ref->cnt = 1;
+			break;
+	}
+	return cpy;
+}
+
+/*
+ * 'pmap' runs workers on threads, each worker evaluates in its own context.
+ * Workers get equal parts of free blocks of caller and copies of its
+ * definitions. Elements are claimed by chunks that get smaller to the end of
+ * the list, so workers with cheap elements take more of them. Result replaces
+ * placeholder in list created by caller. Blocks are the same in all contexts,
+ * so after workers are joined caller takes back their free blocks.
+ */
+
+typedef struct lf_job lf_job;
+
+struct lf_job
+{
+	pthread_mutex_t lock;
+	lf_ctx* ctx;      /* caller context */
+	const lf_obj* fn; /* quotation */
+	lf_obj* src;      /* next unclaimed element */
+	lf_obj* dst;      /* placeholder for its result */
+	unsigned left;    /* count of unclaimed elements */
+	unsigned n;       /* count of workers */
+	lf_sig sig;       /* first signal raised by workers */
+	char msg[128];    /* its message */
+};
+
+typedef struct lf_wrk lf_wrk;
+
+struct lf_wrk
+{
+	lf_ctx ctx;  /* must be first, see wrk_hdl */
+	lf_job* job;
+	lf_obj* fn;  /* copy of quotation */
+	pthread_t thrd;
+	int started;
+};
+
+/*
+ * Workers are taken from static pool instead of stack of caller, nested and
+ * concurrent calls of 'pmap' share it and get fewer workers, when it's used.
+ */
+static lf_wrk pool[LF_THREADS_MAX];
+static int busy[LF_THREADS_MAX];
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Take up to 'n' free workers from pool, returns count of taken */
+static unsigned take_wrk(lf_wrk** wrk, unsigned n)
+{
+	unsigned i, cnt = 0;
+	pthread_mutex_lock(&pool_lock);
+	for (i = 0; i < LF_THREADS_MAX && cnt < n; ++i)
+	{
+		if (!busy[i])
+		{
+			busy[i] = 1;
+			wrk[cnt++] = &pool[i];
+		}
+	}
+	pthread_mutex_unlock(&pool_lock);
+	return cnt;
+}
+
+static void give_wrk(lf_wrk* w)
+{
+	pthread_mutex_lock(&pool_lock);
+	busy[w - pool] = 0;
+	pthread_mutex_unlock(&pool_lock);
+}
+
+static lf_sig wrk_hdl(lf_ctx* ctx, lf_sig sig, const char* msg)
+{
+	lf_job* job = ((lf_wrk*)ctx)->job;
+	pthread_mutex_lock(&job->lock);
+	if (job->sig == LF_SOK)
+	{
+		job->sig = sig;
+		strncpy(job->msg, msg, sizeof(job->msg) - 1);
+	}
+	pthread_mutex_unlock(&job->lock);
+	return sig;
+}
+
+static unsigned claim(lf_job* job, lf_obj** src, lf_obj** dst)
+{
+	unsigned i, n = 0;
+	pthread_mutex_lock(&job->lock);
+	if (job->sig == LF_SOK && job->left > 0)
+	{
+		n = job->left / (job->n * 2) + 1;
+		job->left -= n;
+		*src = job->src;
+		*dst = job->dst;
+		for (i = 0; i < n; ++i)
+		{
+			job->src = job->src->next;
+			job->dst = job->dst->next;
+		}
+	}
+	pthread_mutex_unlock(&job->lock);
+	return n;
+}
+
+/* Shadowed definitions are skipped, if they can't be copied */
+static void copy_dict(lf_ctx* ctx, const lf_ctx* from)
+{
+	lf_obj** tail = &ctx->dict;
+	const lf_obj* it;
+	for (it = from->dict; it != from->base; it = it->next->next)
+	{
+		if (portable(it->next))
+		{
+			*tail = transfer(ctx, it);
+			(*tail)->next = transfer(ctx, it->next);
+			tail = &(*tail)->next->next;
+		}
+	}
+	*tail = from->base;
+	ctx->base = from->base;
+}
+
+/* Raise error for visible definition that can't be copied to workers */
+static void check_copies(lf_ctx* ctx)
+{
+	#define err_msg "can't copy definition '"
+	char buf[sizeof(err_msg) + LF_SYM_MAX_LEN + 1] = err_msg;
+	char* offset = buf + sizeof(err_msg) - 1;
+	const lf_str* str;
+	lf_obj* it;
+	unsigned i;
+	for (it = ctx->dict; it != ctx->base; it = it->next->next)
+	{
+		if (!portable(it->next) && lookup(ctx, it) == it->next)
+		{
+			for (str = str(it); str != NULL; str = str->next)
+			{
+				for (i = 0; str->buf[i] != '\0' &&
+					offset < buf + sizeof(buf) - 2; ++i)
+				{
+					*offset++ = str->buf[i];
+				}
+			}
+			offset[0] = '\'';
+			offset[1] = '\0';
+			lf_raise(ctx, LF_SRUNERR, buf);
+			return;
+		}
+	}
+	#undef err_msg
+}
+
+static void* work(void* arg)
+{
+	lf_wrk* w = (lf_wrk*)arg;
+	lf_ctx* ctx = &w->ctx;
+	lf_obj* src;
+	lf_obj* dst;
+	lf_obj* res;
+	unsigned n;
+	if (setjmp(ctx->sbuf) != LF_SOK)
+	{
+		return NULL;
+	}
+	copy_dict(ctx, w->job->ctx);
+	w->fn = transfer(ctx, w->job->fn);
+	while ((n = claim(w->job, &src, &dst)) > 0)
+	{
+		for (; n > 0; --n, src = src->next, dst = dst->next)
+		{
+			if (!portable(src))
+			{
+				lf_raise(ctx, LF_SRUNERR, "can't transfer element");
+			}
+			push_obj(ctx, transfer(ctx, src));
+			apply(ctx, make_ref(ctx, w->fn));
+			if (ctx->size != 1)
+			{
+				lf_raise(ctx, LF_SRUNERR, "quotation must leave one value");
+			}
+			res = detach(ctx);
+			free_block(ctx, dst->ref);
+			--ctx->objs[dst->type]; /* placeholder is counted by caller */
+			dst->type = res->type;
+			dst->ref = res->ref;
+			free_block(ctx, res);
+		}
+	}
+	return NULL;
+}
+
+/* Give 'n' workers equal parts of free blocks */
+static void share_free(lf_ctx* ctx, lf_wrk** wrk, unsigned n)
+{
+	unsigned long cnt = ctx->nfree, part;
+	lf_obj* it;
+	unsigned i;
+	for (i = 0; i < n; ++i)
+	{
+		part = i + 1 < n ? cnt / n : ctx->nfree;
+		wrk[i]->ctx.free = ctx->free;
+		wrk[i]->ctx.blocks = wrk[i]->ctx.nfree = wrk[i]->ctx.lwm = part;
+		ctx->nfree -= part;
+		for (it = NULL; part > 0 && ctx->free != NULL; --part)
+		{
+			it = ctx->free;
+			ctx->free = ctx->free->next;
+		}
+		if (it != NULL)
+		{
+			it->next = NULL;
+		}
+		else
+		{
+			wrk[i]->ctx.free = NULL;
+		}
+	}
+}
+
+/* Free objects of worker and take back its free blocks and counters */
+static void join_wrk(lf_ctx* ctx, lf_wrk* w)
+{
+	lf_ctx* wctx = &w->ctx;
+	lf_obj* it;
+	unsigned i;
+	if (w->started)
+	{
+		pthread_join(w->thrd, NULL);
+	}
+	drop_frames(wctx);
+	free_hold(wctx);
+	free_list(wctx, wctx->stck);
+	if (w->fn != NULL)
+	{
+		free_obj(wctx, w->fn);
+	}
+	for (it = wctx->dict; it != wctx->base; )
+	{
+		it = free_obj(wctx, free_obj(wctx, it));
+	}
+	if (wctx->free != NULL)
+	{
+		it = wctx->free;
+		while (it->next != NULL)
+		{
+			it = it->next;
+		}
+		it->next = ctx->free;
+		ctx->free = wctx->free;
+	}
+	ctx->nfree += wctx->nfree;
+	ctx->allocs += wctx->allocs;
+	for (i = 0; i <= LF_TCHN; ++i)
+	{
+		ctx->objs[i] += wctx->objs[i];
+	}
+	ctx->strs += wctx->strs;
+}
+
+void lf_pmap(lf_ctx* ctx)
+{
+	lf_wrk* wrk[LF_THREADS_MAX];
+	lf_job job;
+	lf_obj* res;
+	lf_obj* fn;
+	lf_obj* lst;
+	lf_obj** tail;
+	lf_obj* it;
+	lf_num n = lf_to_num(ctx, lf_peek(ctx, 0));
+	unsigned long low;
+	unsigned i, s;
+	check_obj(ctx, lf_peek(ctx, 2), LF_TLST);
+	if (n < 1 || n > LF_THREADS_MAX)
+	{
+		lf_raise(ctx, LF_SRUNERR, "invalid count of threads");
+	}
+	check_copies(ctx);
+	lf_take(ctx, 0);
+	/* Make placeholders for results */
+	res = make_lst(ctx, NULL);
+	push_obj(ctx, res);
+	job.left = 0;
+	tail = &obj(res);
+	for (it = obj(lf_peek(ctx, 2)); it != NULL; it = it->next)
+	{
+		*tail = make_obj(ctx, LF_TNUM);
+		num(*tail) = 0;
+		(*tail)->next = NULL;
+		tail = &(*tail)->next;
+		++job.left;
+	}
+	res = detach(ctx);
+	fn = detach(ctx);
+	lst = detach(ctx);
+	/* Workers without elements would only hold memory */
+	job.n = take_wrk(wrk, job.left > 0 && job.left < n ? job.left : (unsigned)n);
+	if (job.n == 0)
+	{
+		free_obj(ctx, res);
+		free_obj(ctx, fn);
+		free_obj(ctx, lst);
+		lf_raise(ctx, LF_SRUNERR, "no free threads");
+		return;
+	}
+	pthread_mutex_init(&job.lock, NULL);
+	job.ctx = ctx;
+	job.fn = fn;
+	job.src = obj(lst);
+	job.dst = obj(res);
+	job.sig = LF_SOK;
+	job.msg[0] = '\0';
+	job.msg[sizeof(job.msg) - 1] = '\0';
+	for (i = 0; i < job.n; ++i)
+	{
+		lf_init(&wrk[i]->ctx);
+		lf_cfg_io(&wrk[i]->ctx, ctx->rdfn, ctx->wrfn, ctx->wdat);
+		lf_cfg_wrbuf(&wrk[i]->ctx, ctx->wrbuf);
+		for (s = 1; s <= LF_SERR; ++s)
+		{
+			lf_signal(&wrk[i]->ctx, (lf_sig)s, wrk_hdl);
+		}
+		wrk[i]->job = &job;
+		wrk[i]->fn = NULL;
+		wrk[i]->started = 0;
+	}
+	share_free(ctx, wrk, job.n);
+	/* First worker runs on current thread */
+	for (i = 1; i < job.n; ++i)
+	{
+		wrk[i]->started = pthread_create(&wrk[i]->thrd, NULL, work, wrk[i]) == 0;
+	}
+	work(wrk[0]);
+	/* Peak of workers is bounded by sum of their own peaks */
+	low = ctx->nfree;
+	for (i = 0; i < job.n; ++i)
+	{
+		low += wrk[i]->ctx.lwm;
+		join_wrk(ctx, wrk[i]);
+		give_wrk(wrk[i]);
+	}
+	if (low < ctx->lwm)
+	{
+		ctx->lwm = low;
+	}
+	pthread_mutex_destroy(&job.lock);
+	free_obj(ctx, lst);
+	free_obj(ctx, fn);
+	if (job.sig != LF_SOK)
+	{
+		free_obj(ctx, res);
+		lf_raise(ctx, job.sig, job.msg);
+	}
+	push_obj(ctx, res);
+}
+
+/*
+ * Channel is bounded queue (D. Vyukov) of slots, each slot starts with its
+ * sequence number and size of message. Slot is ready for writing, when its
+ * number is equal to count of writes, and for reading, when it is greater by
+ * one. Writers and readers claim slots by atomic increment of their counter,
+ * so channel can have several writers and readers. Message is object
+ * serialized by sender (local encoding) and built in context of receiver.
+ */
+
+#define chn_seq(c, pos) \
+	((unsigned long*)((c)->mem + ((pos) & (c)->mask) * (c)->stride))
+
+unsigned lf_chan_init(lf_chan* chn, void* mem, unsigned size, unsigned msg)
+{
+	unsigned long i, n = 1;
+	chn->mem = (unsigned char*)mem;
+	chn->size = msg;
+	chn->stride = (msg + 3 * sizeof(unsigned long) - 1) / sizeof(unsigned long)
+		* sizeof(unsigned long);
+	if (chn->stride > size)
+	{
+		return 0;
+	}
+	while (n * 2 * chn->stride <= size)
+	{
+		n *= 2;
+	}
+	chn->mask = n - 1;
+	chn->head = 0;
+	chn->tail = 0;
+	for (i = 0; i < n; ++i)
+	{
+		*chn_seq(chn, i) = i;
+	}
+	return (unsigned)n;
+}
+
+/* Claim slot, 'ready' is 0 for writing and 1 for reading */
+static unsigned long* chn_claim(lf_chan* c, unsigned long* cnt,
+	unsigned long ready)
+{
+	unsigned long pos = __atomic_load_n(cnt, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		unsigned long* seq = chn_seq(c, pos);
+		long dif = (long)(__atomic_load_n(seq, __ATOMIC_ACQUIRE) - pos - ready);
+		if (dif == 0)
+		{
+			if (__atomic_compare_exchange_n(cnt, &pos, pos + 1, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				return seq;
+			}
+		}
+		else if (dif < 0)
+		{
+			return NULL; /* full or empty */
+		}
+		else
+		{
+			pos = __atomic_load_n(cnt, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/* Send 'obj' to channel, returns 0 if channel is full */
+static int chn_send(lf_ctx* ctx, lf_obj* obj, lf_chan* c, int wait)
+{
+	unsigned long* seq;
+	unsigned len = dump(ctx, obj, NULL, 0, 1);
+	if (len > c->size)
+	{
+		lf_raise(ctx, LF_SRUNERR, "message is too long");
+	}
+	while ((seq = chn_claim(c, &c->head, 0)) == NULL)
+	{
+		if (!wait)
+		{
+			return 0;
+		}
+		sched_yield();
+	}
+	seq[1] = len;
+	dump(ctx, obj, seq + 2, len, 1);
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* Push message from channel, returns 0 if channel is empty */
+static int chn_recv(lf_ctx* ctx, lf_chan* c, int wait)
+{
+	unsigned long* seq;
+	lf_sig sig;
+	while ((seq = chn_claim(c, &c->tail, 1)) == NULL)
+	{
+		if (!wait)
+		{
+			return 0;
+		}
+		sched_yield();
+	}
+	/* Slot is released even if building of message fails */
+	sig = load(ctx, seq + 2, (unsigned)seq[1], 1);
+	__atomic_store_n(seq, *seq + c->mask, __ATOMIC_RELEASE);
+	if (sig != LF_SOK)
+	{
+		longjmp(ctx->sbuf, sig);
+	}
+	return 1;
+}
+
+void lf_send(lf_ctx* ctx)
+{
+	lf_obj* c = lf_peek(ctx, 0);
+	check_obj(ctx, c, LF_TCHN);
+	chn_send(ctx, lf_peek(ctx, 1), chn(c), 1);
+	lf_take(ctx, 0);
+	lf_take(ctx, 0);
+}
+
+void lf_recv(lf_ctx* ctx)
+{
+	lf_obj* c = lf_peek(ctx, 0);
+	check_obj(ctx, c, LF_TCHN);
+	c = lf_take(ctx, 0);
+	chn_recv(ctx, chn(c), 1);
+}
+
+void lf_tsnd(lf_ctx* ctx)
+{
+	lf_obj* c = lf_peek(ctx, 0);
+	int ok;
+	check_obj(ctx, c, LF_TCHN);
+	ok = chn_send(ctx, lf_peek(ctx, 1), chn(c), 0);
+	lf_take(ctx, 0);
+	if (ok)
+	{
+		lf_take(ctx, 0);
+	}
+	push_cond(ctx, ok);
+}
+
+void lf_trcv(lf_ctx* ctx)
+{
+	lf_obj* c = lf_peek(ctx, 0);
+	check_obj(ctx, c, LF_TCHN);
+	c = lf_take(ctx, 0);
+	push_cond(ctx, chn_recv(ctx, chn(c), 0));
+}
+
+#endif /* LF_THREADS */
+
+/******************************************************************************
+ * Profiling
+ *****************************************************************************/
+
+#ifdef LF_PROFILE
+
+/*
+ * Call of definition is counted when its symbol is evaluated and timed from
+ * pushing of its frame to freeing of it, so tail call ends time of caller.
+ * Native function bound to symbol is timed while it runs. Calls are kept in
+ * stack of profiler, their paths are nodes of tree (for folded stacks).
+ * Time is taken from clock of host or counted in evaluated steps.
+ */
+
+#define PROF_NONE ((unsigned)-1)
+
+#define prof_now(p) ((p)->clock != NULL ? (p)->clock() : (p)->steps)
+
+static int prof_name_eq(const char* name, const lf_str* str)
+{
+	unsigned i = 0;
+	char c;
+	while ((c = str_getc(&str, &i)) != '\0' && c == *name)
+	{
+		++name;
+	}
+	return c == *name;
+}
+
+/* Count call of symbol, its frame (if any) is entered next */
+static void prof_call(lf_ctx* ctx, const lf_obj* sym)
+{
+	lf_prof* p = ctx->prof;
+	unsigned h = hash_obj(sym);
+	unsigned i = h & (LF_PROF_DEFS - 1);
+	unsigned n;
+	for (n = 0; p->defs[i].name[0] != '\0'; ++n)
+	{
+		if (n == LF_PROF_DEFS)
+		{
+			++p->lost;
+			p->call = PROF_NONE;
+			return;
+		}
+		if (p->defs[i].hash == h && prof_name_eq(p->defs[i].name, str(sym)))
+		{
+			break;
+		}
+		i = (i + 1) & (LF_PROF_DEFS - 1);
+	}
+	if (p->defs[i].name[0] == '\0')
+	{
+		const lf_str* str = str(sym);
+		unsigned k = 0;
+		char c;
+		n = 0;
+		while (n < LF_SYM_MAX_LEN - 1 && (c = str_getc(&str, &k)) != '\0')
+		{
+			p->defs[i].name[n++] = c;
+		}
+		p->defs[i].name[n] = '\0';
+		p->defs[i].hash = h;
+	}
+	++p->defs[i].calls;
+	p->call = i;
+}
+
+/* Start timing of called definition, 'key' identifies its frame */
+static void prof_enter(lf_ctx* ctx, const void* key)
+{
+	lf_prof* p = ctx->prof;
+	unsigned def = p->call;
+	unsigned parent, i, n;
+	p->call = PROF_NONE;
+	if (def == PROF_NONE || key == NULL)
+	{
+		return;
+	}
+	if (p->depth == LF_PROF_DEPTH)
+	{
+		++p->lost;
+		return;
+	}
+	parent = p->depth > 0 ? p->stck[p->depth - 1].node : PROF_NONE;
+	i = (parent * 31 + def) & (LF_PROF_NODES - 1);
+	for (n = 0; p->nodes[i].def != PROF_NONE; ++n)
+	{
+		if (n == LF_PROF_NODES)
+		{
+			++p->lost;
+			return;
+		}
+		if (p->nodes[i].parent == parent && p->nodes[i].def == def)
+		{
+			break;
+		}
+		i = (i + 1) & (LF_PROF_NODES - 1);
+	}
+	p->nodes[i].parent = parent;
+	p->nodes[i].def = def;
+	p->stck[p->depth].key = key;
+	p->stck[p->depth].node = i;
+	p->stck[p->depth].start = prof_now(p);
+	p->stck[p->depth].child = 0;
+	++p->depth;
+}
+
+/* Stop timing of call, if it's timed */
+static void prof_leave(lf_ctx* ctx, const void* key)
+{
+	lf_prof* p = ctx->prof;
+	unsigned i = p->depth;
+	unsigned j, def;
+	unsigned long time;
+	while (i-- > 0)
+	{
+		if (p->stck[i].key == key)
+		{
+			time = prof_now(p) - p->stck[i].start;
+			def = p->nodes[p->stck[i].node].def;
+			p->nodes[p->stck[i].node].self += time - p->stck[i].child;
+			p->defs[def].self += time - p->stck[i].child;
+			/* Total time of recursive definition is counted by outer call */
+			j = 0;
+			while (j < i && p->nodes[p->stck[j].node].def != def)
+			{
+				++j;
+			}
+			if (j == i)
+			{
+				p->defs[def].total += time;
+			}
+			if (i > 0)
+			{
+				p->stck[i - 1].child += time;
+			}
+			/* Calls above it are left by other coroutine */
+			for (--p->depth; i < p->depth; ++i)
+			{
+				p->stck[i] = p->stck[i + 1];
+			}
+			return;
+		}
+	}
+}
+
+static void prof_alloc(lf_ctx* ctx)
+{
+	lf_prof* p = ctx->prof;
+	if (p->depth > 0)
+	{
+		++p->defs[p->nodes[p->stck[p->depth - 1].node].def].allocs;
+	}
+}
+
+/* Evaluation is interrupted, unfinished calls are not counted */
+static void prof_drop(lf_ctx* ctx)
+{
+	ctx->prof->depth = 0;
+	ctx->prof->call = PROF_NONE;
+}
+
+void lf_prof_start(lf_ctx* ctx, lf_prof* prof, lf_clock clock)
+{
+	unsigned i;
+	memset(prof, 0, sizeof(*prof));
+	for (i = 0; i < LF_PROF_NODES; ++i)
+	{
+		prof->nodes[i].def = PROF_NONE;
+	}
+	prof->clock = clock;
+	prof->call = PROF_NONE;
+	ctx->prof = prof;
+}
+
+void lf_prof_stop(lf_ctx* ctx)
+{
+	ctx->prof = NULL;
+}
+
+/* Write definitions sorted by self time */
+void lf_prof_report(lf_ctx* ctx, const lf_prof* prof)
+{
+	unsigned i, k, n;
+	unsigned long last = (unsigned long)-1;
+	unsigned prev = PROF_NONE;
+	char buf[64];
+	writeln(ctx, "     calls       self      total     allocs  name");
+	for (n = 0; n < LF_PROF_DEFS; ++n)
+	{
+		/* Next by order of (self desc, index asc) */
+		k = PROF_NONE;
+		for (i = 0; i < LF_PROF_DEFS; ++i)
+		{
+			const lf_pdef* d = &prof->defs[i];
+			if (d->name[0] != '\0' && (d->self < last || (d->self == last
+				&& (prev == PROF_NONE || i > prev))) && (k == PROF_NONE
+				|| d->self > prof->defs[k].self))
+			{
+				k = i;
+			}
+		}
+		if (k == PROF_NONE)
+		{
+			break;
+		}
+		sprintf(buf, "%10lu %10lu %10lu %10lu  ", prof->defs[k].calls,
+			prof->defs[k].self, prof->defs[k].total, prof->defs[k].allocs);
+		writestr(ctx, buf);
+		writeln(ctx, prof->defs[k].name);
+		last = prof->defs[k].self;
+		prev = k;
+	}
+	if (prof->lost > 0)
+	{
+		sprintf(buf, "%lu calls are not profiled", prof->lost);
+		writeln(ctx, buf);
+	}
+	flush_out(ctx);
+}
+
+/* Write self time of each path of calls as 'a;b;c time' */
+void lf_prof_folded(lf_ctx* ctx, const lf_prof* prof)
+{
+	unsigned path[LF_PROF_DEPTH];
+	unsigned i, n;
+	char buf[32];
+	for (i = 0; i < LF_PROF_NODES; ++i)
+	{
+		if (prof->nodes[i].def != PROF_NONE && prof->nodes[i].self > 0)
+		{
+			path[0] = i;
+			for (n = 0; prof->nodes[path[n]].parent != PROF_NONE; ++n)
+			{
+				path[n + 1] = prof->nodes[path[n]].parent;
+			}
+			for (++n; n-- > 0;)
+			{
+				writestr(ctx, prof->defs[prof->nodes[path[n]].def].name);
+				writech(ctx, n > 0 ? ';' : ' ');
+			}
+			sprintf(buf, "%lu", prof->nodes[i].self);
+			writeln(ctx, buf);
+		}
+	}
+	flush_out(ctx);
+}
+
+#endif /* LF_PROFILE */
+
+/******************************************************************************
+ * Math operations
+ *****************************************************************************/
+
+/* Replace number on top by 'n', in place if it isn't shared */
+static void set_top(lf_ctx* ctx, lf_num n)
+{
+	if (ctx->stck->ref->cnt == 1)
+	{
+		num(ctx->stck) = n;
+	}
+	else
+	{
+		lf_take(ctx, 0);
+		lf_push_num(ctx, n);
+	}
+}
+
+/* Replace two numbers on top by 'n' */
+static void set_top2(lf_ctx* ctx, lf_num n)
+{
+	ctx->stck = free_obj(ctx, ctx->stck);
+	--ctx->size;
+	set_top(ctx, n);
+}
+
+#define both_num(ctx) \
+	((ctx)->stck->type == LF_TNUM && (ctx)->stck->next->type == LF_TNUM)
+
+/* Numbers are checked first, vector math also raises error of types */
+#define mathop(name, o) \
+	void lf_##name(lf_ctx* ctx) \
+	{ \
+		lf_peek(ctx, 1); \
+		if (both_num(ctx)) \
+		{ \
+			set_top2(ctx, num(ctx->stck->next) o num(ctx->stck)); \
+		} \
+		else \
+		{ \
+			vec_math(ctx, vec_##name); \
+		} \
+	}
+
+mathop(add, +)
+mathop(sub, -)
+mathop(mul, *)
+mathop(div, /)
+
+#undef mathop
+
+void lf_mod(lf_ctx* ctx)
+{
+	lf_num n;
+	lf_peek(ctx, 1);
+	n = fmod(lf_to_num(ctx, ctx->stck->next), lf_to_num(ctx, ctx->stck));
+	set_top2(ctx, n);
+}
+
+void lf_sgn(lf_ctx* ctx)
+{
+	lf_num n = lf_to_num(ctx, lf_peek(ctx, 0));
+	set_top(ctx, n < 0.0 ? -1.0 : n > 0.0 ? 1.0 : 0.0);
+}
+
+/* Add 'n' to number on top, 0 if top isn't number */
+static int add_num(lf_ctx* ctx, lf_num n)
+{
+	if (lf_peek(ctx, 0)->type != LF_TNUM)
+	{
+		return 0;
+	}
+	set_top(ctx, num(ctx->stck) + n);
+	return 1;
+}
+
+static void fused_inc(lf_ctx* ctx)
+{
+	if (!add_num(ctx, 1.0))
+	{
+		lf_push_num(ctx, 1.0);
+		lf_add(ctx);
+	}
+}
+
+static void fused_dec(lf_ctx* ctx)
+{
+	if (!add_num(ctx, -1.0))
+	{
+		lf_push_num(ctx, 1.0);
+		lf_sub(ctx);
+	}
+}
+
+static void fused_cmp(lf_ctx* ctx)
+{
+	lf_num n;
+	lf_peek(ctx, 1);
+	if (!both_num(ctx))
+	{
+		lf_sub(ctx);
+		lf_sgn(ctx);
+		return;
+	}
+	n = num(ctx->stck->next) - num(ctx->stck);
+	set_top2(ctx, n < 0.0 ? -1.0 : n > 0.0 ? 1.0 : 0.0);
+}
+
+/******************************************************************************
+ * Data constructors
+ *****************************************************************************/
+
+void lf_push_lst(lf_ctx* ctx)
+{
+	lf_obj* obj = make_obj(ctx, LF_TLST);
+	obj(obj) = NULL;
+	push_obj(ctx, obj);
+}
+
+void lf_push_sym(lf_ctx* ctx, const char* sym, unsigned len)
+{
+	lf_obj* obj = make_obj(ctx, LF_TSYM);
+	str(obj) = build_string(ctx, sym, len == 0 ? strlen(sym) : len);
+	push_obj(ctx, obj);
+}
+
+void lf_push_str(lf_ctx* ctx, const char* str, unsigned len)
+{
+	lf_obj* obj = make_obj(ctx, LF_TSTR);
+	str(obj) = build_string(ctx, str, len == 0 ? strlen(str) : len);
+	push_obj(ctx, obj);
+}
+
+void lf_push_buf(lf_ctx* ctx, void* dat, unsigned len, lf_btype type,
+	lf_fin fin)
+{
+	lf_obj* obj;
+	lf_buf* buf;
+	lf_push_usr(ctx, dat, fin);
+	buf = (lf_buf*)make_block(ctx);
+	buf->dat = (char*)dat;
+	buf->type = type;
+	/* Move owner of memory from stack */
+	buf->base = ctx->stck;
+	ctx->stck = ctx->stck->next;
+	buf->base->next = NULL;
+	--ctx->size;
+	obj = make_obj(ctx, LF_TBUF);
+	obj->ref->buf.len = len;
+	buf(obj) = buf;
+	push_obj(ctx, obj);
+}
+
+void lf_push_bld(lf_ctx* ctx)
+{
+	lf_obj* obj = make_obj(ctx, LF_TBLD);
+	obj->ref->bld.len = 0;
+	bld(obj) = (lf_sbld*)make_block(ctx);
+	sbld_open(bld(obj), NULL);
+	push_obj(ctx, obj);
+}
+
+#ifdef LF_THREADS
+void lf_push_chn(lf_ctx* ctx, lf_chan* chn)
+{
+	lf_obj* obj = make_obj(ctx, LF_TCHN);
+	chn(obj) = chn;
+	push_obj(ctx, obj);
+}
+#endif
+
+void lf_push_map(lf_ctx* ctx)
+{
+	lf_obj* obj = make_obj(ctx, LF_TMAP);
+	obj->ref->map.len = 0;
+	map(obj) = NULL;
+	push_obj(ctx, obj);
+}
+
+void lf_push_arr(lf_ctx* ctx)
+{
+	push_obj(ctx, make_arr(ctx, LF_TARR, 0));
+}
+
+void lf_push_vec(lf_ctx* ctx)
+{
+	push_obj(ctx, make_arr(ctx, LF_TVEC, 0));
+}
+
+void lf_push_ntv(lf_ctx* ctx, lf_ntv ntv)
+{
+	lf_obj* obj = make_obj(ctx, LF_TNTV);
+	ntv(obj) = ntv;
+	push_obj(ctx, obj);
+}
+
+void lf_push_num(lf_ctx* ctx, lf_num num)
+{
+	lf_obj* obj = make_obj(ctx, LF_TNUM);
+	num(obj) = num;
+	push_obj(ctx, obj);
+}
+
+static void no_fin(lf_ctx* ctx, void* dat)
+{
+	(void) ctx;
+	(void) dat;
+} 
+
+void lf_push_usr(lf_ctx* ctx, void* dat, lf_fin fin)
+{
+	lf_obj* obj = make_obj(ctx, LF_TUSR);
+	usr(obj).dat = dat;
+	usr(obj).fin = fin == NULL ? no_fin : fin;
+	push_obj(ctx, obj);
+}
+
+/******************************************************************************
+ * Static checking
+ *****************************************************************************/
+
+/*
+ * Code is evaluated on abstract stack of types, values are kept while they
+ * are known (literals, elements of stack, numbers computed from them). Lists
+ * and definitions are followed as they would be called, both branches of
+ * 'eq' are checked and their stacks are merged, so values of conditions
+ * ('&t' or '&f') are followed too. Check stops silently when effect of code
+ * can't be known: natives without effect, recursion, lists made at runtime.
+ * Errors are raised only if they happen on every path of evaluation.
+ */
+
+#define CHK_ANY   (LF_TCHN + 1) /* type is not known */
+#define CHK_SAME  (LF_TCHN + 2) /* result has type of deepest argument */
+#define CHK_MATH  (LF_TCHN + 3) /* result is number or vector */
+#define CHK_DEFS  (64)
+#define CHK_STEPS (1L << 16)
+#define T(t) (1u << LF_T##t)
+#define T_KEY (T(STR) | T(SYM) | T(NUM))
+
+/* Effects of natives, 'req' are types required from top of stack (0 is any) */
+static const struct
+{
+	lf_ntv fn;
+	unsigned char in;
+	unsigned char out;
+	unsigned char res;
+	unsigned req[3];
+}
+effects[] =
+{
+	{ lf_is, 1, 1, LF_TSTR, { 0 } },
+	{ lf_sz, 0, 1, LF_TNUM, { 0 } },
+	{ lf_memo, 2, 1, LF_TLST, { T(NUM) } },
+	{ lf_add, 2, 1, CHK_MATH, { T(NUM) | T(VEC), T(NUM) | T(VEC) } },
+	{ lf_sub, 2, 1, CHK_MATH, { T(NUM) | T(VEC), T(NUM) | T(VEC) } },
+	{ lf_mul, 2, 1, CHK_MATH, { T(NUM) | T(VEC), T(NUM) | T(VEC) } },
+	{ lf_div, 2, 1, CHK_MATH, { T(NUM) | T(VEC), T(NUM) | T(VEC) } },
+	{ lf_mod, 2, 1, LF_TNUM, { T(NUM), T(NUM) } },
+	{ lf_sgn, 1, 1, LF_TNUM, { T(NUM) } },
+	{ lf_push_map, 0, 1, LF_TMAP, { 0 } },
+	{ lf_get, 2, 1, CHK_ANY, { T_KEY, T(MAP) } },
+	{ lf_put, 3, 1, LF_TMAP, { 0, T_KEY, T(MAP) } },
+	{ lf_del, 2, 1, LF_TMAP, { T_KEY, T(MAP) } },
+	{ lf_has, 2, 1, LF_TLST, { T_KEY, T(MAP) } },
+	{ lf_keys, 1, 1, LF_TLST, { T(MAP) } },
+	{ lf_push_arr, 0, 1, LF_TARR, { 0 } },
+	{ lf_nth, 2, 1, CHK_ANY, { T(NUM), T(ARR) | T(VEC) | T(BUF) } },
+	{ lf_set, 3, 1, CHK_SAME, { 0, T(NUM), T(ARR) | T(VEC) } },
+	{ lf_len, 1, 1, LF_TNUM,
+		{ T(LST) | T(MAP) | T(ARR) | T(VEC) | T(BUF) } },
+	{ lf_slc, 3, 1, CHK_SAME, { T(NUM), T(NUM), T(ARR) | T(VEC) | T(BUF) } },
+	{ lf_psh, 2, 1, CHK_SAME, { 0, T(ARR) | T(VEC) } },
+	{ lf_push_vec, 0, 1, LF_TVEC, { 0 } },
+	{ lf_sum, 1, 1, LF_TNUM, { T(VEC) | T(BUF) | T(SEQ) } },
+	{ lf_dot, 2, 1, LF_TNUM, { T(VEC) | T(BUF), T(VEC) | T(BUF) } },
+	{ lf_rng, 2, 1, LF_TSEQ, { T(NUM), T(NUM) } },
+	{ lf_smap, 2, 1, CHK_SAME, { 0, T(LST) | T(SEQ) } },
+	{ lf_sflt, 2, 1, CHK_SAME, { 0, T(LST) | T(SEQ) } },
+	{ lf_stak, 2, 1, LF_TSEQ, { T(NUM), T(SEQ) } },
+	{ lf_lrev, 1, 1, LF_TLST, { T(LST) } },
+	{ lf_cat, 2, 1, LF_TLST, { T(LST), T(LST) } },
+	{ lf_sort, 1, 1, LF_TLST, { T(LST) } },
+	{ lf_scat, 2, 1, LF_TSTR, { T(STR), T(STR) } },
+	{ lf_slen, 1, 1, LF_TNUM, { T(STR) } },
+	{ lf_ssub, 3, 1, LF_TSTR, { T(NUM), T(NUM), T(STR) } },
+	{ lf_sfnd, 2, 1, LF_TNUM, { T(STR), T(STR) } },
+	{ lf_ntos, 1, 1, LF_TSTR, { T(NUM) } },
+	{ lf_push_bld, 0, 1, LF_TBLD, { 0 } },
+	{ lf_badd, 2, 1, LF_TBLD, { T(NUM) | T(STR) | T(SYM), T(BLD) } },
+	{ lf_bstr, 1, 1, LF_TSTR, { T(BLD) } },
+	{ lf_spwn, 1, 1, LF_TCOR, { T(LST) } }
+#ifdef LF_THREADS
+	, { lf_pmap, 3, 1, LF_TLST, { T(NUM), 0, T(LST) } },
+	{ lf_send, 2, 0, CHK_ANY, { T(CHN) } },
+	{ lf_recv, 1, 1, CHK_ANY, { T(CHN) } }
+#endif
+};
+
+/* Element of abstract stack */
+typedef struct
+{
+	unsigned char type;  /* type, CHK_ANY if not known */
+	unsigned char known; /* number 'num' is known */
+	lf_num num;
+	const lf_obj* val;   /* known value, or NULL */
+	const lf_obj* alt;   /* other possible value, if 'val' is known */
+}
+chk_val;
+
+typedef struct
+{
+	chk_val vals[LF_CHECK_DEPTH]; /* elements, last one is top of stack */
+	lf_int size;                  /* count of 'vals' */
+	lf_int below;                 /* count of elements below, -1 if unknown */
+	const lf_obj* next;           /* next element below, if they are known */
+	lf_int in;                    /* count of elements taken from below */
+	lf_int height;                /* size of stack relative to start */
+}
+chk_stack;
+
+typedef struct
+{
+	lf_ctx* ctx;
+	jmp_buf stop;                       /* stops check of unknown effect */
+	const lf_obj* sym;                  /* checked definition, for messages */
+	const lf_ref* lists[LF_CHECK_NEST]; /* checked lists, to find recursion */
+	unsigned nest;
+	unsigned quiet;                     /* errors may not happen, if not 0 */
+	unsigned long steps;
+	struct
+	{
+		const lf_obj* name;
+		const lf_obj* val; /* NULL if definition is removed or not known */
+	}
+	defs[CHK_DEFS];                     /* definitions made by checked code */
+	unsigned ndefs;
+}
+checker;
+
+static void check_stop(checker* c)
+{
+	longjmp(c->stop, 1);
+}
+
+/*
+ * Raise error that happens on evaluated path. Errors of branches and of
+ * definitions with unknown arguments may not happen, they stop check.
+ */
+static void check_fail(checker* c, lf_sig sig, const char* msg)
+{
+	char buf[80 + LF_SYM_MAX_LEN];
+	unsigned n = strlen(msg);
+	if (c->quiet != 0)
+	{
+		check_stop(c);
+	}
+	memcpy(buf, msg, n);
+	if (c->sym != NULL)
+	{
+		const lf_str* str = str(c->sym);
+		unsigned k = 0;
+		char ch;
+		memcpy(buf + n, " in '", 5);
+		n += 5;
+		while (n < sizeof(buf) - 2 && (ch = str_getc(&str, &k)) != '\0')
+		{
+			buf[n++] = ch;
+		}
+		buf[n++] = '\'';
+	}
+	buf[n] = '\0';
+	lf_raise(c->ctx, sig, buf);
+}
+
+static chk_val* check_push(checker* c, chk_stack* s, unsigned type)
+{
+	chk_val* v;
+	if (s->size == LF_CHECK_DEPTH)
+	{
+		check_stop(c);
+	}
+	v = &s->vals[s->size++];
+	v->type = type;
+	v->known = 0;
+	v->val = NULL;
+	v->alt = NULL;
+	++s->height;
+	return v;
+}
+
+static void check_value(chk_val* v, const lf_obj* obj)
+{
+	v->type = obj->type;
+	v->known = obj->type == LF_TNUM;
+	v->num = v->known ? num(obj) : 0;
+	v->val = obj;
+	v->alt = NULL;
+}
+
+/* Make sure that 'n' top elements are in 'vals', elements below are moved */
+static void check_need(checker* c, chk_stack* s, lf_int n)
+{
+	lf_int i, k = n - s->size;
+	if (k <= 0)
+	{
+		return;
+	}
+	else if (n > LF_CHECK_DEPTH)
+	{
+		check_stop(c);
+	}
+	else if (s->below >= 0 && s->below < k)
+	{
+		check_fail(c, LF_SUNDFLW, "stack underflow");
+		check_stop(c);
 	}
-	else
+	memmove(s->vals + k, s->vals, s->size * sizeof(chk_val));
+	for (i = k; i-- > 0;)
 	{
-		free_obj(ctx, t);
-		apply(ctx, e);
+		if (s->next != NULL)
+		{
+			check_value(&s->vals[i], s->next);
+			s->next = s->next->next;
+		}
+		else
+		{
+			s->vals[i].type = CHK_ANY;
+			s->vals[i].known = 0;
+			s->vals[i].val = NULL;
+			s->vals[i].alt = NULL;
+		}
+	}
+	s->size = n;
+	s->in += k;
+	if (s->below >= 0)
+	{
+		s->below -= k;
 	}
 }
 
-void lf_is(lf_ctx* ctx)
+static chk_val* check_top(checker* c, chk_stack* s, lf_int idx)
 {
-	lf_push_str(ctx, lf_typenames[lf_take(ctx, 0)->type], 3);
+	check_need(c, s, idx + 1);
+	return &s->vals[s->size - 1 - idx];
 }
 
-void lf_rf(lf_ctx* ctx)
+static chk_val check_pop(checker* c, chk_stack* s)
 {
-	lf_int idx = lf_to_num(ctx, lf_take(ctx, 0));
-	push_obj(ctx, make_ref(ctx, lf_peek(ctx, idx)));
+	check_need(c, s, 1);
+	--s->height;
+	return s->vals[--s->size];
 }
 
-void lf_sz(lf_ctx* ctx)
+/* Check that element at 'idx' has one of types of 'mask' */
+static void check_arg(checker* c, chk_stack* s, lf_int idx, unsigned mask)
 {
-	lf_push_num(ctx, ctx->size);
+	unsigned type = check_top(c, s, idx)->type;
+	if (mask != 0 && type != CHK_ANY && (mask & (1u << type)) == 0)
+	{
+		char buf[80];
+		unsigned i, n = sprintf(buf, "expected ");
+		for (i = 0; i <= LF_TCHN; ++i)
+		{
+			if (mask & (1u << i))
+			{
+				n += sprintf(buf + n, "%s%s", buf[n - 1] != ' ' ? "|" : "",
+					lf_typenames[i]);
+			}
+		}
+		sprintf(buf + n, ", got %s", lf_typenames[type]);
+		check_fail(c, LF_SRUNERR, buf);
+	}
 }
 
-/******************************************************************************
- * Math operations
- *****************************************************************************/
-
-#define mathop(name, o) \
-	void lf_##name(lf_ctx* ctx) \
-	{ \
-		lf_num n; \
-		lf_peek(ctx, 1); \
-		n = lf_to_num(ctx, ctx->stck->next) o lf_to_num(ctx, ctx->stck); \
-		ctx->size -= 2; \
-		ctx->stck = free_obj(ctx, free_obj(ctx, ctx->stck)); \
-		lf_push_num(ctx, n); \
+/* Value of symbol, definitions made by checked code are found first */
+static const lf_obj* check_find(checker* c, const lf_obj* sym)
+{
+	const lf_obj* val;
+	unsigned i = c->ndefs;
+	while (i-- > 0)
+	{
+		if (streq(str(c->defs[i].name), str(sym)))
+		{
+			if (c->defs[i].val == NULL)
+			{
+				check_stop(c);
+			}
+			return c->defs[i].val;
+		}
 	}
+	if ((val = lookup(c->ctx, sym)) == NULL)
+	{
+		check_stop(c);
+	}
+	return val;
+}
 
-mathop(add, +)
-mathop(sub, -)
-mathop(mul, *)
-mathop(div, /)
-
-#undef mathop
+static void check_apply(checker* c, chk_stack* s, const chk_val* v);
 
-void lf_mod(lf_ctx* ctx)
+/* Check branches 'a' and 'b', stack is merged from their stacks */
+static void check_fork(checker* c, chk_stack* s, const chk_val* a,
+	const chk_val* b)
 {
-	lf_num n;
-	lf_peek(ctx, 1);	
-	n = fmod(lf_to_num(ctx, ctx->stck->next), lf_to_num(ctx, ctx->stck));
-	ctx->size -= 2;
-	ctx->stck = free_obj(ctx, free_obj(ctx, ctx->stck));
-	lf_push_num(ctx, n);
+	chk_stack t = *s;
+	lf_int i;
+	++c->quiet;
+	check_apply(c, s, a);
+	check_apply(c, &t, b);
+	--c->quiet;
+	if (s->height != t.height)
+	{
+		check_stop(c); /* branches leave different count of elements */
+	}
+	check_need(c, s, s->size + t.in - s->in);
+	check_need(c, &t, t.size + s->in - t.in);
+	for (i = 0; i < s->size; ++i)
+	{
+		chk_val* x = &s->vals[i];
+		const chk_val* y = &t.vals[i];
+		if (x->type != y->type)
+		{
+			x->type = CHK_ANY;
+		}
+		if (!x->known || !y->known || x->num != y->num)
+		{
+			x->known = 0;
+		}
+		if (x->val == NULL || y->val == NULL || x->alt != NULL ||
+			y->alt != NULL)
+		{
+			x->val = NULL;
+			x->alt = NULL;
+		}
+		else if (!objeq(x->val, y->val))
+		{
+			x->alt = y->val;
+		}
+	}
 }
 
-void lf_sgn(lf_ctx* ctx)
+static void check_native(checker* c, chk_stack* s, lf_ntv fn);
+
+/* Check object as it's called by 'call' */
+static void check_call(checker* c, chk_stack* s, const lf_obj* obj)
 {
-	lf_num n = lf_to_num(ctx, lf_take(ctx, 0));
-	lf_push_num(ctx, n < 0.0 ? -1.0 : n > 0.0 ? 1.0 : 0.0);
+	const lf_obj* sym = c->sym;
+	const lf_obj* it;
+	unsigned i;
+	switch (obj->type)
+	{
+		case LF_TLST:
+			for (i = 0; i < c->nest; ++i)
+			{
+				if (c->lists[i] == obj->ref)
+				{
+					check_stop(c); /* recursion */
+				}
+			}
+			if (c->nest == LF_CHECK_NEST)
+			{
+				check_stop(c);
+			}
+			c->lists[c->nest++] = obj->ref;
+			for (it = obj(obj); it != NULL; it = it->next)
+			{
+				if (++c->steps > CHK_STEPS)
+				{
+					check_stop(c);
+				}
+				if (it->type == LF_TSYM || it->type == LF_TNTV)
+				{
+					check_call(c, s, it);
+				}
+				else
+				{
+					check_value(check_push(c, s, it->type), it);
+				}
+			}
+			--c->nest;
+			break;
+		case LF_TSYM:
+			c->sym = obj;
+			check_call(c, s, check_find(c, obj));
+			c->sym = sym;
+			break;
+		case LF_TNTV:
+			check_native(c, s, ntv(obj));
+			break;
+		default:
+			check_value(check_push(c, s, obj->type), obj);
+			break;
+	}
 }
 
-/******************************************************************************
- * Data constructors
- *****************************************************************************/
+static void check_apply(checker* c, chk_stack* s, const chk_val* v)
+{
+	if (v->alt != NULL)
+	{
+		chk_val a = *v;
+		chk_val b = *v;
+		a.alt = NULL;
+		b.val = v->alt;
+		b.alt = NULL;
+		check_fork(c, s, &a, &b);
+	}
+	else if (v->val != NULL)
+	{
+		check_call(c, s, v->val);
+	}
+	else if (v->type == LF_TLST || v->type == LF_TSYM ||
+		v->type == LF_TNTV || v->type == CHK_ANY)
+	{
+		check_stop(c);
+	}
+	else
+	{
+		*check_push(c, s, v->type) = *v;
+	}
+}
 
-void lf_push_lst(lf_ctx* ctx)
+/* Definitions are followed when they are called, symbols are bound late */
+static void check_dict(checker* c, chk_stack* s, lf_ntv fn)
 {
-	lf_obj* obj = make_obj(ctx);
-	obj->type = LF_TLST;
-	obj(obj) = NULL;
-	push_obj(ctx, obj);
+	chk_val name, val;
+	check_arg(c, s, 0, T(STR));
+	name = check_pop(c, s);
+	if (name.val == NULL || name.alt != NULL)
+	{
+		check_stop(c);
+	}
+	else if (fn == lf_fnd)
+	{
+		check_value(check_push(c, s, 0), check_find(c, name.val));
+		return;
+	}
+	else if (c->quiet != 0 || c->ndefs == CHK_DEFS)
+	{
+		check_stop(c); /* definitions of branches are not followed */
+	}
+	c->defs[c->ndefs].name = name.val;
+	c->defs[c->ndefs].val = NULL;
+	++c->ndefs;
+	if (fn == lf_reg)
+	{
+		val = check_pop(c, s);
+		if (val.alt == NULL)
+		{
+			c->defs[c->ndefs - 1].val = val.val;
+		}
+	}
 }
 
-void lf_push_sym(lf_ctx* ctx, const char* sym, unsigned len)
+/* Natives taking count from top of stack */
+static void check_count(checker* c, chk_stack* s, lf_ntv fn, lf_int n)
 {
-	lf_obj* obj = make_obj(ctx);
-	obj->type = LF_TSYM;
-	str(obj) = build_string(ctx, sym, len == 0 ? strlen(sym) : len);
-	push_obj(ctx, obj);
+	chk_val v;
+	lf_int i;
+	if (fn == lf_rol)
+	{
+		check_need(c, s, (n < 0 ? -n : n) + 1);
+		if (n > 0)
+		{
+			v = s->vals[s->size - 1 - n];
+			memmove(s->vals + s->size - 1 - n, s->vals + s->size - n,
+				n * sizeof(chk_val));
+			s->vals[s->size - 1] = v;
+		}
+		else if (n < 0)
+		{
+			v = s->vals[s->size - 1];
+			memmove(s->vals + s->size + n, s->vals + s->size + n - 1,
+				-n * sizeof(chk_val));
+			s->vals[s->size - 1 + n] = v;
+		}
+		return;
+	}
+	else if (n < 0)
+	{
+		check_stop(c);
+	}
+	check_need(c, s, n + 1);
+	if (fn == lf_cpy || fn == lf_rf)
+	{
+		v = s->vals[s->size - 1 - n];
+		*check_push(c, s, v.type) = v;
+	}
+	else if (fn == lf_drp)
+	{
+		memmove(s->vals + s->size - 1 - n, s->vals + s->size - n,
+			n * sizeof(chk_val));
+		--s->size;
+		--s->height;
+	}
+	else
+	{
+		if (fn == lf_vwrp)
+		{
+			for (i = 0; i <= n; ++i)
+			{
+				check_arg(c, s, i, T(NUM));
+			}
+		}
+		s->size -= n + 1;
+		s->height -= n + 1;
+		check_push(c, s, fn == lf_wrp ? LF_TLST :
+			fn == lf_awrp ? LF_TARR : LF_TVEC);
+	}
 }
 
-void lf_push_str(lf_ctx* ctx, const char* str, unsigned len)
+/* Check native by its effect */
+static void check_native(checker* c, chk_stack* s, lf_ntv fn)
 {
-	lf_obj* obj = make_obj(ctx);
-	obj->type = LF_TSTR;
-	str(obj) = build_string(ctx, str, len == 0 ? strlen(str) : len);
-	push_obj(ctx, obj);
+	chk_val v, a, b;
+	chk_val* r;
+	const lf_obj* it;
+	unsigned i, k, type;
+	for (i = 0; i < sizeof(fusions) / sizeof(fusions[0]); ++i)
+	{
+		if (fusions[i].fn == fn)
+		{
+			if (fusions[i].pre != NULL)
+			{
+				check_native(c, s, fusions[i].pre);
+			}
+			else
+			{
+				r = check_push(c, s, LF_TNUM);
+				r->known = 1;
+				r->num = fusions[i].arg;
+			}
+			check_native(c, s, fusions[i].op);
+			return;
+		}
+	}
+	for (i = 0; i < sizeof(effects) / sizeof(effects[0]); ++i)
+	{
+		if (effects[i].fn != fn)
+		{
+			continue;
+		}
+		check_need(c, s, effects[i].in);
+		for (k = 0; k < effects[i].in; ++k)
+		{
+			check_arg(c, s, k, effects[i].req[k]);
+		}
+		type = effects[i].res;
+		if (effects[i].in != 0)
+		{
+			a = s->vals[s->size - effects[i].in];
+			b = s->vals[s->size - 1];
+		}
+		if (type == CHK_SAME)
+		{
+			type = a.type;
+		}
+		else if (type == CHK_MATH)
+		{
+			type = a.type == LF_TNUM && b.type == LF_TNUM ? LF_TNUM :
+				a.type == LF_TVEC || b.type == LF_TVEC ? LF_TVEC : CHK_ANY;
+		}
+		s->size -= effects[i].in;
+		s->height -= effects[i].in;
+		if (effects[i].out != 0)
+		{
+			r = check_push(c, s, type);
+			/* Numbers are computed, so counts and conditions are known */
+			if (type == LF_TNUM && effects[i].in != 0 && a.known && b.known)
+			{
+				r->known = fn == lf_add || fn == lf_sub || fn == lf_mul ||
+					fn == lf_div || fn == lf_mod || fn == lf_sgn;
+				r->num = fn == lf_add ? a.num + b.num :
+					fn == lf_sub ? a.num - b.num :
+					fn == lf_mul ? a.num * b.num :
+					fn == lf_div ? a.num / b.num :
+					fn == lf_mod ? fmod(a.num, b.num) :
+					b.num < 0.0 ? -1.0 : b.num > 0.0 ? 1.0 : 0.0;
+			}
+		}
+		return;
+	}
+	if (fn == lf_rol || fn == lf_cpy || fn == lf_drp || fn == lf_wrp ||
+		fn == lf_rf || fn == lf_awrp || fn == lf_vwrp)
+	{
+		check_arg(c, s, 0, T(NUM));
+		v = check_pop(c, s);
+		if (!v.known)
+		{
+			check_stop(c);
+		}
+		check_count(c, s, fn, (lf_int)v.num);
+	}
+	else if (fn == lf_pul)
+	{
+		check_arg(c, s, 0, T(LST));
+		v = check_pop(c, s);
+		if (v.val == NULL || v.alt != NULL)
+		{
+			check_stop(c);
+		}
+		for (k = 0, it = obj(v.val); it != NULL; it = it->next, ++k)
+		{
+			check_value(check_push(c, s, it->type), it);
+		}
+		r = check_push(c, s, LF_TNUM);
+		r->known = 1;
+		r->num = k;
+	}
+	else if (fn == lf_apl)
+	{
+		v = check_pop(c, s);
+		check_apply(c, s, &v);
+	}
+	else if (fn == lf_eq)
+	{
+		check_need(c, s, 4);
+		b = check_pop(c, s); /* 'else' branch */
+		a = check_pop(c, s); /* 'then' branch */
+		v = check_pop(c, s);
+		r = check_top(c, s, 0);
+		--s->size;
+		--s->height;
+		if (r->known && v.known)
+		{
+			check_apply(c, s, r->num == v.num ? &a : &b);
+		}
+		else if (r->val != NULL && v.val != NULL && r->alt == NULL &&
+			v.alt == NULL)
+		{
+			check_apply(c, s, objeq(r->val, v.val) ? &a : &b);
+		}
+		else if (r->type != CHK_ANY && v.type != CHK_ANY && r->type != v.type)
+		{
+			check_apply(c, s, &b);
+		}
+		else
+		{
+			check_fork(c, s, &a, &b);
+		}
+	}
+	else if (fn == lf_reg || fn == lf_rem || fn == lf_fnd)
+	{
+		check_dict(c, s, fn);
+	}
+	else if (fn == lf_min || fn == lf_max)
+	{
+		type = check_top(c, s, 0)->type;
+		if (type == LF_TNUM)
+		{
+			check_arg(c, s, 1, T(NUM));
+			check_pop(c, s);
+		}
+		else if (type != LF_TVEC && type != LF_TBUF)
+		{
+			check_stop(c);
+		}
+		check_pop(c, s);
+		check_push(c, s, LF_TNUM);
+	}
+	else
+	{
+		check_stop(c); /* effect is not known */
+	}
 }
 
-void lf_push_ntv(lf_ctx* ctx, lf_ntv ntv)
+/* Check list over 'below' elements from 'next', -1 if they aren't known */
+static void check_code(checker* c, const lf_obj* list, lf_int below,
+	const lf_obj* next, lf_eff* eff)
 {
-	lf_obj* obj = make_obj(ctx);
-	obj->type = LF_TNTV;
-	ntv(obj) = ntv;
-	push_obj(ctx, obj);
+	chk_stack s;
+	s.size = 0;
+	s.below = below;
+	s.next = next;
+	s.in = 0;
+	s.height = 0;
+	c->quiet = below < 0;
+	if (setjmp(c->stop) == 0)
+	{
+		check_call(c, &s, list);
+		if (eff != NULL)
+		{
+			eff->in = s.in;
+			eff->out = s.in + s.height;
+			eff->known = 1;
+		}
+	}
 }
 
-void lf_push_num(lf_ctx* ctx, lf_num num)
+static void check_open(checker* c, lf_ctx* ctx, lf_eff* eff)
 {
-	lf_obj* obj = make_obj(ctx);
-	obj->type = LF_TNUM;
-	num(obj) = num;
-	push_obj(ctx, obj);
+	c->ctx = ctx;
+	c->sym = NULL;
+	c->nest = 0;
+	c->quiet = 0;
+	c->steps = 0;
+	c->ndefs = 0;
+	if (eff != NULL)
+	{
+		eff->in = 0;
+		eff->out = 0;
+		eff->known = 0;
+	}
 }
 
-static void no_fin(lf_ctx* ctx, void* dat)
+lf_sig lf_check(lf_ctx* ctx, const lf_chk* chk, lf_eff* eff)
 {
-	(void) ctx;
-	(void) dat;
-} 
+	jmp_buf sbuf;
+	checker c;
+	lf_sig sig;
+	check_open(&c, ctx, eff);
+	memcpy(sbuf, ctx->sbuf, sizeof(jmp_buf));
+	sig = (lf_sig)setjmp(ctx->sbuf);
+	if (sig == LF_SOK && chk->next == NULL)
+	{
+		lf_obj list;
+		lf_ref ref;
+		/* Chunk is checked as list of its elements */
+		ref.obj.val = chk->head;
+		list.type = LF_TLST;
+		list.ref = &ref;
+		check_code(&c, &list, ctx->size, ctx->stck, eff);
+	}
+	memcpy(ctx->sbuf, sbuf, sizeof(jmp_buf));
+	return sig;
+}
 
-void lf_push_usr(lf_ctx* ctx, void* dat, lf_fin fin)
+lf_sig lf_effect(lf_ctx* ctx, lf_int idx, lf_eff* eff)
 {
-	lf_obj* obj = make_obj(ctx);
-	obj->type = LF_TUSR;
-	usr(obj).dat = dat;
-	usr(obj).fin = fin == NULL ? no_fin : fin;
-	push_obj(ctx, obj);
+	jmp_buf sbuf;
+	checker c;
+	lf_sig sig;
+	check_open(&c, ctx, eff);
+	memcpy(sbuf, ctx->sbuf, sizeof(jmp_buf));
+	sig = (lf_sig)setjmp(ctx->sbuf);
+	if (sig == LF_SOK)
+	{
+		const lf_obj* obj = lf_peek(ctx, idx);
+		if (obj->type == LF_TLST)
+		{
+			check_code(&c, obj, -1, NULL, eff);
+		}
+	}
+	memcpy(ctx->sbuf, sbuf, sizeof(jmp_buf));
+	return sig;
 }
 
+#undef CHK_ANY
+#undef CHK_SAME
+#undef CHK_MATH
+#undef CHK_DEFS
+#undef CHK_STEPS
+#undef T
+#undef T_KEY
+
 /******************************************************************************
  * Standalone interpreter
  *****************************************************************************/
@@ -1321,6 +7017,11 @@ static void writefn(void* wdat, char c)
 	fputc(c, (FILE*)wdat);
 }
 
+static void writebuf(void* wdat, const char* buf, unsigned len)
+{
+	fwrite(buf, 1, len, (FILE*)wdat);
+}
+
 static lf_sig unfchk_hdl(lf_ctx* ctx, lf_sig sig, const char* msg)
 {
 	(void) ctx;
@@ -1328,9 +7029,27 @@ static lf_sig unfchk_hdl(lf_ctx* ctx, lf_sig sig, const char* msg)
 	return sig;
 }
 
+static lf_sig warn_hdl(lf_ctx* ctx, lf_sig sig, const char* msg)
+{
+	writestr(ctx, "warning: ");
+	writeln(ctx, msg);
+	flush_out(ctx);
+	return sig;
+}
+
+/* Errors found by check are warnings, chunk is evaluated anyway */
+static void check(lf_ctx* ctx, const lf_chk* chk)
+{
+	lf_signal(ctx, LF_SRUNERR, warn_hdl);
+	lf_signal(ctx, LF_SUNDFLW, warn_hdl);
+	lf_check(ctx, chk, NULL);
+	lf_signal(ctx, LF_SRUNERR, lf_dfl_hdl);
+	lf_signal(ctx, LF_SUNDFLW, lf_dfl_hdl);
+}
+
 static void repl(lf_ctx* ctx)
 {
-	lf_chk* nest;	
+	lf_chk* nest;
 	lf_chk* chk = NULL;
 	lf_signal(ctx, LF_SUNFCHK, unfchk_hdl);
 	for (;;)
@@ -1345,6 +7064,7 @@ static void repl(lf_ctx* ctx)
 		fputs("> ", stdout);
 		if (lf_read(ctx, &chk, (void*)stdin) == LF_SOK)
 		{
+			check(ctx, chk);
 			switch (lf_eval(ctx, chk))
 			{
 				case LF_SOK:
@@ -1378,6 +7098,7 @@ static void dofile(lf_ctx* ctx, const char* filename)
 	if (fp != NULL)
 	{
 		lf_read(ctx, &chk, fp);
+		check(ctx, chk);
 		lf_eval(ctx, chk);
 		lf_wipe(ctx, &chk);
 		fclose(fp);
@@ -1398,6 +7119,7 @@ int main(int argc, char** argv)
 	lf_init(&ctx);
 	lf_map_mem(&ctx, heap, sizeof(heap));
 	lf_cfg_io(&ctx, readfn, writefn, stdout);
+	lf_cfg_wrbuf(&ctx, writebuf);
 
 	dofile(&ctx, "lib.lf");
 
@@ -1407,9 +7129,30 @@ int main(int argc, char** argv)
 			repl(&ctx);
 			break;
 		case 2:
+#ifdef LF_PROFILE
+		{
+			/* Time is counted in steps, folded stacks are written to file */
+			static lf_prof prof;
+			FILE* fp;
+			lf_prof_start(&ctx, &prof, NULL);
+			dofile(&ctx, argv[1]);
+			lf_prof_stop(&ctx);
+			lf_trace(&ctx);
+			lf_prof_report(&ctx, &prof);
+			if ((fp = fopen("lifo.folded", "w")) != NULL)
+			{
+				lf_cfg_io(&ctx, NULL, NULL, fp);
+				lf_prof_folded(&ctx, &prof);
+				lf_cfg_io(&ctx, NULL, NULL, stdout);
+				fclose(fp);
+			}
+			break;
+		}
+#else
 			dofile(&ctx, argv[1]);
 			lf_trace(&ctx);
 			break;
+#endif
 		default:
 			fprintf(stdout, "usage: %s [<filename>]\n", argv[0]);
 			break;
@@ -15,6 +15,14 @@
 #define LF_BLOCK_SIZE  (sizeof(void*) * 3)
 #define LF_STRBUF_SIZE (sizeof(void*) * 2)
 #define LF_SYM_MAX_LEN (64)
+#define LF_MEMO_SIZE   (64)
+#define LF_THREADS_MAX (64)
+#define LF_OBUF_SIZE   (256)
+#define LF_PROF_DEFS   (256)  /* power of two */
+#define LF_PROF_NODES  (1024) /* power of two */
+#define LF_PROF_DEPTH  (64)
+#define LF_CHECK_DEPTH (32)
+#define LF_CHECK_NEST  (32)
 
 #ifdef __cplusplus
 extern "C"
@@ -28,10 +36,27 @@ typedef enum lf_type
 	LF_TSTR, /* string */
 	LF_TNTV, /* native function */
 	LF_TNUM, /* number */
-	LF_TUSR  /* userdata */
+	LF_TUSR, /* userdata */
+	LF_TMAP, /* map */
+	LF_TARR, /* array */
+	LF_TVEC, /* vector */
+	LF_TBUF, /* buffer */
+	LF_TSEQ, /* sequence */
+	LF_TBLD, /* string builder */
+	LF_TCOR, /* coroutine */
+	LF_TCHN  /* channel */
 }
 lf_type;
 
+typedef enum lf_btype
+{
+	LF_BCHR, /* unsigned char */
+	LF_BINT, /* int */
+	LF_BNUM, /* lf_num */
+	LF_BDBL  /* double */
+}
+lf_btype;
+
 typedef enum lf_sig
 {
 	LF_SOK = 0, /* signal 'ok' */
@@ -42,7 +67,9 @@ typedef enum lf_sig
 	LF_SOVRFLW, /* signal 'stack overflow' */
 	LF_SUNDFLW, /* signal 'stack underflow' */
 	LF_SINIERR, /* signal 'initialization error' */
-	LF_SERR     /* signal 'other error' */
+	LF_SERR,    /* signal 'other error' */
+	LF_SYIELD,  /* signal 'budget of steps is spent' (not error) */
+	LF_SWAIT    /* signal 'context waits for lf_complete' (not error) */
 }
 lf_sig;
 
@@ -53,8 +80,10 @@ typedef struct lf_obj lf_obj;
 typedef struct lf_str lf_str;
 typedef struct lf_chk lf_chk;
 typedef struct lf_ctx lf_ctx;
+typedef struct lf_chan lf_chan;
 typedef char (*lf_rdfn)(void* rdat);
 typedef void (*lf_wrfn)(void* wdat, char c);
+typedef void (*lf_wrbuf)(void* wdat, const char* buf, unsigned len);
 typedef void (*lf_ntv)(lf_ctx* ctx);
 typedef void (*lf_fin)(lf_ctx* ctx, void* dat);
 typedef lf_sig (*lf_hdl)(lf_ctx* ctx, lf_sig sig, const char* msg);
@@ -65,6 +94,114 @@ struct lf_str
 	lf_str* next;
 };
 
+/* Statistics of memory, values are counted once for all references to them */
+typedef struct lf_stats
+{
+	unsigned long blocks;            /* count of blocks given by lf_map_mem */
+	unsigned long free;              /* count of free blocks */
+	unsigned long peak;              /* most blocks used since lf_mem_reset */
+	unsigned long allocs;            /* count of allocations since lf_mem_reset */
+	unsigned long objs[LF_TCHN + 1]; /* live values of each type */
+	unsigned long strs;              /* count of string fragments */
+	unsigned long defs;              /* count of definitions in dictionary */
+	lf_int depth;                    /* largest stack size since lf_mem_reset */
+}
+lf_stats;
+
+/* Stack effect of code found by lf_check or lf_effect */
+typedef struct lf_eff
+{
+	lf_int in;  /* count of elements taken from stack */
+	lf_int out; /* count of elements put in their place */
+	int known;  /* 1 if code is checked to its end */
+}
+lf_eff;
+
+#ifdef LF_THREADS
+/* Bounded queue of serialized objects, memory of slots is owned by host */
+struct lf_chan
+{
+	unsigned char* mem;  /* slots */
+	unsigned size;       /* max size of message */
+	unsigned stride;     /* size of slot */
+	unsigned long mask;  /* count of slots - 1 */
+	char pad0[64];       /* counters are on separate cache lines */
+	unsigned long head;  /* count of claimed writes */
+	char pad1[64];
+	unsigned long tail;  /* count of claimed reads */
+	char pad2[64];
+};
+#endif
+
+#ifdef LF_PROFILE
+typedef unsigned long (*lf_clock)(void);
+
+/* Profile of definition */
+typedef struct lf_pdef
+{
+	char name[LF_SYM_MAX_LEN]; /* name, empty if entry is free */
+	unsigned hash;             /* hash of name */
+	unsigned long calls;       /* count of calls */
+	unsigned long self;        /* time without called definitions */
+	unsigned long total;       /* time with called definitions */
+	unsigned long allocs;      /* count of blocks allocated by itself */
+}
+lf_pdef;
+
+/* State of profiler, memory is owned by host */
+typedef struct lf_prof
+{
+	lf_clock clock;       /* time source, if NULL time is count of steps */
+	unsigned long steps;  /* count of evaluated steps */
+	unsigned long lost;   /* count of calls that are not profiled */
+	unsigned call;        /* definition called by next frame */
+	unsigned depth;       /* count of timed calls */
+	lf_pdef defs[LF_PROF_DEFS];
+	struct
+	{
+		unsigned parent;     /* node of caller */
+		unsigned def;        /* called definition */
+		unsigned long self;  /* time without called definitions */
+	}
+	nodes[LF_PROF_NODES]; /* tree of paths of calls */
+	struct
+	{
+		const void* key;     /* frame of call */
+		unsigned node;       /* path of call */
+		unsigned long start; /* time of call */
+		unsigned long child; /* time of called definitions */
+	}
+	stck[LF_PROF_DEPTH];  /* timed calls */
+}
+lf_prof;
+#endif
+
+#ifdef LF_HOOKS
+typedef enum lf_htype
+{
+	LF_HCALL   = 1,  /* native function is called */
+	LF_HRET    = 2,  /* native function returned */
+	LF_HFIND   = 4,  /* symbol is found in dictionary */
+	LF_HALLOC  = 8,  /* block is allocated */
+	LF_HFREE   = 16, /* block is freed */
+	LF_HSIGNAL = 32  /* signal is raised */
+}
+lf_htype;
+
+/* Event passed to hook, fields that are not used by event are zero */
+typedef struct lf_event
+{
+	lf_htype type;   /* type of event */
+	lf_ntv ntv;      /* native function (LF_HCALL, LF_HRET) */
+	const void* ptr; /* symbol (LF_HFIND) or block (LF_HALLOC, LF_HFREE) */
+	lf_sig sig;      /* signal (LF_HSIGNAL) */
+	const char* msg; /* message of signal */
+}
+lf_event;
+
+typedef void (*lf_hook)(lf_ctx* ctx, const lf_event* ev);
+#endif
+
 extern const char lf_typenames[][4];
 
 /******************************************************************************
@@ -74,7 +211,15 @@ extern const char lf_typenames[][4];
 void lf_init(lf_ctx* ctx);
 void lf_reset(lf_ctx* ctx);
 void lf_cfg_io(lf_ctx* ctx, lf_rdfn rdfn, lf_wrfn wrfn, void* wdat);
+void lf_cfg_wrbuf(lf_ctx* ctx, lf_wrbuf wrbuf);
+#ifdef LF_HOOKS
+void lf_set_hook(lf_ctx* ctx, unsigned mask, lf_hook hook);
+#endif
 void lf_map_mem(lf_ctx* ctx, void* mem, unsigned size);
+void lf_mem_stats(const lf_ctx* ctx, lf_stats* stats);
+void lf_mem_reset(lf_ctx* ctx);
+void lf_freeze(lf_ctx* ctx);
+void lf_share(lf_ctx* ctx, const lf_ctx* img);
 
 /******************************************************************************
  * Signal handling and tracing 
@@ -91,7 +236,13 @@ void lf_signal(lf_ctx* ctx, lf_sig sig, lf_hdl hdl);
 
 lf_sig lf_read(lf_ctx* ctx, lf_chk** chk, void* rdat);
 lf_sig lf_eval(lf_ctx* ctx, const lf_chk* chk);
+lf_sig lf_eval_budget(lf_ctx* ctx, const lf_chk* chk, unsigned steps);
+lf_sig lf_resume(lf_ctx* ctx);
+void lf_suspend(lf_ctx* ctx, void* handle);
+lf_sig lf_complete(lf_ctx* ctx, void* handle);
 void lf_wipe(lf_ctx* ctx, lf_chk** chk);
+lf_sig lf_check(lf_ctx* ctx, const lf_chk* chk, lf_eff* eff);
+lf_sig lf_effect(lf_ctx* ctx, lf_int idx, lf_eff* eff);
 
 /******************************************************************************
  * API 
@@ -105,6 +256,8 @@ lf_ntv lf_to_ntv(lf_ctx* ctx, const lf_obj* obj);
 lf_obj* lf_to_lst(lf_ctx* ctx, const lf_obj* obj);
 void* lf_to_usr(lf_ctx* ctx, const lf_obj* obj);
 const lf_str* lf_to_str(lf_ctx* ctx, const lf_obj* obj);
+unsigned lf_dump(lf_ctx* ctx, lf_int idx, void* buf, unsigned size);
+lf_sig lf_load(lf_ctx* ctx, const void* buf, unsigned len);
 
 /******************************************************************************
  * Stack operations
@@ -133,6 +286,99 @@ void lf_eq(lf_ctx* ctx);
 void lf_is(lf_ctx* ctx);
 void lf_rf(lf_ctx* ctx);
 void lf_sz(lf_ctx* ctx);
+void lf_memo(lf_ctx* ctx);
+
+/******************************************************************************
+ * Map operations
+ *****************************************************************************/
+
+void lf_get(lf_ctx* ctx);
+void lf_put(lf_ctx* ctx);
+void lf_del(lf_ctx* ctx);
+void lf_has(lf_ctx* ctx);
+void lf_keys(lf_ctx* ctx);
+
+/******************************************************************************
+ * Array and vector operations
+ *****************************************************************************/
+
+void lf_awrp(lf_ctx* ctx);
+void lf_apul(lf_ctx* ctx);
+void lf_vwrp(lf_ctx* ctx);
+void lf_vpul(lf_ctx* ctx);
+void lf_nth(lf_ctx* ctx);
+void lf_set(lf_ctx* ctx);
+void lf_len(lf_ctx* ctx);
+void lf_slc(lf_ctx* ctx);
+void lf_psh(lf_ctx* ctx);
+void lf_sum(lf_ctx* ctx);
+void lf_min(lf_ctx* ctx);
+void lf_max(lf_ctx* ctx);
+void lf_dot(lf_ctx* ctx);
+
+/******************************************************************************
+ * Sequence operations
+ *****************************************************************************/
+
+void lf_rng(lf_ctx* ctx);
+void lf_smap(lf_ctx* ctx);
+void lf_sflt(lf_ctx* ctx);
+void lf_stak(lf_ctx* ctx);
+void lf_each(lf_ctx* ctx);
+void lf_spul(lf_ctx* ctx);
+void lf_fold(lf_ctx* ctx);
+
+/******************************************************************************
+ * List operations
+ *****************************************************************************/
+
+void lf_lrev(lf_ctx* ctx);
+void lf_cat(lf_ctx* ctx);
+void lf_sort(lf_ctx* ctx);
+
+/******************************************************************************
+ * String operations
+ *****************************************************************************/
+
+void lf_scat(lf_ctx* ctx);
+void lf_slen(lf_ctx* ctx);
+void lf_ssub(lf_ctx* ctx);
+void lf_sfnd(lf_ctx* ctx);
+void lf_ntos(lf_ctx* ctx);
+void lf_badd(lf_ctx* ctx);
+void lf_bstr(lf_ctx* ctx);
+
+/******************************************************************************
+ * Coroutine operations
+ *****************************************************************************/
+
+void lf_spwn(lf_ctx* ctx);
+void lf_cres(lf_ctx* ctx);
+void lf_yld(lf_ctx* ctx);
+
+/******************************************************************************
+ * Parallel operations (only if LF_THREADS is defined)
+ *****************************************************************************/
+
+#ifdef LF_THREADS
+unsigned lf_chan_init(lf_chan* chn, void* mem, unsigned size, unsigned msg);
+void lf_pmap(lf_ctx* ctx);
+void lf_send(lf_ctx* ctx);
+void lf_recv(lf_ctx* ctx);
+void lf_tsnd(lf_ctx* ctx);
+void lf_trcv(lf_ctx* ctx);
+#endif
+
+/******************************************************************************
+ * Profiling (only if LF_PROFILE is defined)
+ *****************************************************************************/
+
+#ifdef LF_PROFILE
+void lf_prof_start(lf_ctx* ctx, lf_prof* prof, lf_clock clock);
+void lf_prof_stop(lf_ctx* ctx);
+void lf_prof_report(lf_ctx* ctx, const lf_prof* prof);
+void lf_prof_folded(lf_ctx* ctx, const lf_prof* prof);
+#endif
 
 /******************************************************************************
  * Math operations
@@ -155,6 +401,15 @@ void lf_push_str(lf_ctx* ctx, const char* str, unsigned len);
 void lf_push_ntv(lf_ctx* ctx, lf_ntv ntv);
 void lf_push_num(lf_ctx* ctx, lf_num num);
 void lf_push_usr(lf_ctx* ctx, void* dat, lf_fin fin);
+void lf_push_buf(lf_ctx* ctx, void* dat, unsigned len, lf_btype type,
+	lf_fin fin);
+void lf_push_map(lf_ctx* ctx);
+void lf_push_arr(lf_ctx* ctx);
+void lf_push_vec(lf_ctx* ctx);
+void lf_push_bld(lf_ctx* ctx);
+#ifdef LF_THREADS
+void lf_push_chn(lf_ctx* ctx, lf_chan* chn);
+#endif
 
 #ifdef __cplusplus
 }